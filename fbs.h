@@ -0,0 +1,456 @@
+// FBS4000 - Future Backing Storage for RC4000 w. DRC401 and a BeagleBone (tm)
+// Definitions shared between the drum loop and the support modules
+
+#ifndef FBS_H
+#define FBS_H
+
+#include <stdint.h>
+#include <syslog.h>
+#include "fbs_stats.h"
+
+// ****************************
+// *** SYSLOG DEFINITIONS:  ***
+// ****************************
+
+// Mask bits for syslogging
+#define G_SEEK    1
+#define G_DATA    2
+#define G_ERROR   4
+#define G_STAT    8
+#define G_MISC  256
+
+extern uint32_t logmask;
+
+#define FBS_LOG(group, args...) \
+do { \
+    if (logmask & (group)) syslog(LOG_INFO, ##args); \
+} while (0);
+
+
+// ****************************
+// ***** FBS GPIO INPUTS: *****
+// ****************************
+
+// Input, serial output from DSA shift register
+#define GP_SRDATA_BANK      0
+#define GP_SRDATA_BIT       20
+
+// Input, Write Data from DRC
+#define GP_WRDATA_BANK      1   // SP0(0)
+#define GP_WRDATA_BIT       12
+
+// Input, Write Enable from DRC
+#define GP_WE_BANK          1
+#define GP_WE_BIT           14
+
+// Input, CP_DSP, clock pulse incrementing Drum Segment Address in DRC
+#define GP_CPDSA_BANK       1
+#define GP_CPDSA_BIT        16
+
+// Input, latched G_i_First_Segment - First Segment was written to DRC by RC4000
+#define GP_SRRQ_BANK        1
+#define GP_SRRQ_BIT         17
+
+
+// *****************************
+// ***** FBS GPIO OUTPUTS: *****
+// *****************************
+
+// Output, clock to DSA shift register
+#define GP_SRCLK_BANK       0
+#define GP_SRCLK_BIT        26
+
+// Output, Connected status to DRC
+#define GP_CONN_BANK        1
+#define GP_CONN_BIT         29
+
+// Output, drum index to DRC
+#define GP_INDEX_BANK       2
+#define GP_INDEX_BIT        1
+
+// Output, Read Data to DRC
+#define GP_RDDATA_BANK      2
+#define GP_RDDATA_BIT       3
+
+// Output, drum clock to DRC
+#define GP_RDCLK_BANK       2
+#define GP_RDCLK_BIT        4
+
+#define MAX_GPIO_BANKS              (4)
+
+// GPIO register size
+#define AM335X_GPIO_SIZE            0x1000
+
+#define AM335X_GPIO_OE              0x134
+#define AM335X_GPIO_DATAIN          0x138
+#define AM335X_GPIO_DATAOUT         0x13C
+#define AM335X_GPIO_CLEARDATAOUT    0x190
+#define AM335X_GPIO_SETDATAOUT      0x194
+
+extern void *gpio_addr[MAX_GPIO_BANKS];
+extern volatile uint32_t *gpio_dataout_addr[MAX_GPIO_BANKS];
+extern volatile uint32_t *gpio_datain_addr[MAX_GPIO_BANKS];
+extern uint32_t gpio_mirror[MAX_GPIO_BANKS];
+
+// GPIO backend. The default backend is the AM335x GPIO banks mapped from
+// /dev/mem. Building with FBS_SIM replaces them with a register file in
+// memory and an in-process DRC401, which is told about every store.
+#ifdef FBS_SIM
+void sim_gpio_map();
+void sim_gpio_stored(int bank);
+#define GPIO_STORED(bank) sim_gpio_stored(bank)
+#else
+#define GPIO_STORED(bank)
+#endif
+
+// Update GPIO bank 2 w. clk, data, index bits
+#define UPD_DRC \
+do { \
+    *gpio_dataout_addr[2] = gpio_mirror[2]; \
+    GPIO_STORED(2); \
+} while (0)
+
+// Precompiled waveform: per bit cell the bank 2 clk, data and index bits
+// with RDCLK high and low. The other bank 2 bits (LEDs) are or'ed in.
+#define WAVE_CELL   2
+#define WAVE_WORD   (24*WAVE_CELL)
+#define WAVE_MASK   ((1<<GP_RDCLK_BIT) | (1<<GP_RDDATA_BIT) | (1<<GP_INDEX_BIT))
+
+#define UPD_WAVE(val) \
+do { \
+    *gpio_dataout_addr[2] = (val); \
+    GPIO_STORED(2); \
+} while (0)
+
+
+#define INVMASK24  0x66666600
+#define INVMASK32  0x66666666
+
+#define MAXUNITS 4
+
+// Words per sector in the track buffer: 256 data, parity, 11 address words
+#define SECT_WORDS 268
+
+extern uint32_t *img[MAXUNITS];
+extern uint32_t unit_segs[MAXUNITS];
+extern int selected_unit;
+extern uint32_t dsa;
+extern uint32_t trackcnt;
+extern int seek_error;
+
+void abend(char *s);
+
+// Unit images (fbs_img.c)
+
+// Drum format image: header, then per track the 4*268 words of trbuf
+#define DRUM_MAGIC          "FBS4DRM"
+#define DRUM_VERSION        1
+#define DRUM_HDR_SIZE       4096
+#define DRUM_TRACK_WORDS    (4*SECT_WORDS)
+
+struct drum_hdr
+{
+    char magic[8];
+    uint32_t version;
+    uint32_t tracks;
+    uint32_t track_words;   // DRUM_TRACK_WORDS
+};
+
+struct img_stats
+{
+    uint64_t dirtied;   // Bytes stored, explicit I/O units
+    uint64_t written;   // Bytes written to their files
+    uint32_t writes;
+};
+
+extern struct img_stats imgstat;
+
+void img_open(int unit, char *fname, char *oname, char *io);
+void img_close(int unit);
+const uint32_t *img_track(int unit, uint32_t track);
+void img_store_sector(int unit, uint32_t seg, const uint32_t *data);
+const uint32_t *img_drum_track(int unit, uint32_t track);
+int img_read_card(int unit, uint32_t track, uint32_t *buf);
+void img_store_drum(int unit, uint32_t seg, const uint32_t *words);
+void img_sync(int unit);
+void img_prefault(int tracks);
+void img_prefault_bg();
+void img_prefault_stop();
+void img_writeback();
+void img_idle();
+
+// Drum loop (fbs_main.c)
+void gpio_init();
+int send_rcv_words(uint32_t *ptr, int words, uint32_t *wbuf);
+int send_rcv_wave(uint32_t *ptr, uint32_t *wv, int words, uint32_t *wbuf);
+extern uint32_t bit_ticks;
+void bit_init();
+int poll_dsa(uint32_t *reg);
+int do_word_257_267(uint32_t *ptr, int index_sector, uint32_t *w267, int *accessed);
+int write_sector(int sect, uint32_t *wr_buf, uint32_t segm_addr_w);
+void blink(int led, uint32_t len);
+void upd_leds();
+
+// Sector kernels (fbs_kernels.c)
+struct sector_kernel
+{
+    char *name;
+    uint32_t (*encode)(uint32_t *trb, const uint32_t *imgptr, uint32_t parity);
+    void (*decode)(uint32_t *imgptr, const uint32_t *trb);
+};
+
+extern struct sector_kernel sector_kernels[];
+extern uint32_t (*encode_sector)(uint32_t *trb, const uint32_t *imgptr, uint32_t parity);
+extern void (*decode_sector)(uint32_t *imgptr, const uint32_t *trb);
+
+void kernels_init();
+uint32_t fbs_crc32(uint32_t crc, const void *buf, uint32_t len);
+int kernel_check(struct sector_kernel *k);
+
+// Track buffer and cache (fbs_track.c)
+struct trcache_stats
+{
+    uint32_t hits;
+    uint32_t misses;
+    uint32_t evictions;
+    uint32_t dirty_evictions;   // Written back inside the word 257-267 window
+    uint32_t writebacks;        // Written back at end of rotation
+    uint32_t prefetches;        // Next track encoded ahead
+    uint32_t pf_hits;           // ... and then seeked to
+    uint32_t pf_misses;         // Seek to the next track, not prefetched
+    uint32_t lazy_encodes;      // Sectors encoded by track_sector()
+    uint32_t scrubbed;          // Sectors checked
+    uint32_t scrub_errors;
+};
+
+extern uint32_t *trbuf;     // Current track, 4*268 24-bit words
+extern int *dirty;          // Dirty sectors of current track
+extern int *wave_ok;        // Sectors of current track with a valid waveform
+extern struct trcache_stats trstat;
+
+void trcache_init();
+uint32_t *track_wave(uint32_t *ptr);
+void track_expand();
+void track_sector(int sect);
+void fetch_track();
+void flush_track();
+void trcache_prefetch();
+void trcache_scrub();
+void trcache_writeback();
+void trcache_flush();
+int trcache_dirty();
+void trcache_sync();
+void trcache_reset();
+
+// Background writer (fbs_writer.c)
+struct writer_stats
+{
+    uint32_t queued;
+    uint32_t full;      // Ring full when queueing
+    uint32_t maxdepth;  // High water mark
+    uint32_t waits;     // Drum loop had to wait for the writer
+};
+
+extern struct writer_stats wrstat;
+
+void writer_init();
+uint32_t writer_put(int unit, uint32_t seg, uint32_t *data, int wait);
+int writer_done(uint32_t seq);
+void writer_wait(uint32_t seq);
+void writer_drain();
+uint32_t writer_seq();
+
+// Statistics segment (fbs_stats.c)
+extern struct fbs_stats stats;
+
+void stats_init();
+void stats_publish();
+
+// Sector checksums and scrubber (fbs_sum.c)
+struct sum_stats
+{
+    uint32_t checked;   // Tracks
+    uint32_t passes;
+    uint32_t errors;    // Segments
+    int unit;           // Being scrubbed
+    uint32_t track;
+};
+
+extern int sum_on;
+extern struct sum_stats sumstat;
+
+void sum_init();
+void sum_open(int unit, char *fname);
+void sum_store(int unit, uint32_t seg);
+void sum_sync(int unit);
+void sum_close(int unit);
+void sum_scrub();
+
+// Replication to a mirror (fbs_repl.c)
+#define REPL_MAGIC      0x46425352  // "FBSR"
+
+struct repl_batch       // On the socket, followed by count struct repl_rec
+{
+    uint32_t magic;
+    uint32_t seq;       // Of the first record, per connection
+    uint32_t count;
+};
+
+struct repl_rec
+{
+    uint32_t unit;
+    uint32_t seg;
+    uint32_t data[192]; // Packed, as in an image
+};
+
+struct repl_stats
+{
+    // Updated by the writer and the replication thread
+    _Atomic uint32_t queued;    // Sectors
+    _Atomic uint32_t sent;
+    _Atomic uint32_t batches;
+    _Atomic uint32_t lag;       // Sectors not queued or not sent, tracks resynced instead
+    _Atomic uint32_t resynced;  // Tracks
+};
+
+extern int repl_on;
+extern struct repl_stats replstat;
+
+void repl_open(int unit, char *target);
+void repl_store(int unit, uint32_t seg);
+void repl_close(int unit);
+void repl_sync();
+uint32_t repl_pending();
+
+// Point-in-time snapshots (fbs_snap.c)
+struct snap_stats
+{
+    uint32_t taken;
+    uint32_t cow;       // Tracks copied before they were overwritten
+    uint32_t copied;    // Tracks copied in the background
+};
+
+extern struct snap_stats snapstat;
+
+void snap_init();
+void snap_request();
+void snap_open(int unit, char *sname, char *fname);
+void snap_close(int unit);
+void snap_point();
+void snap_writer(uint32_t stored);
+void snap_cow(int unit, uint32_t seg);
+
+// Write-ahead journal (fbs_journal.c)
+extern int journal_on;
+extern int journal_ms;
+extern int journal_batch;
+
+void journal_init();
+void journal_open(int unit, char *fname);
+void journal_append(int unit, uint32_t seg, uint32_t *data);
+void journal_sync();
+void journal_checkpoint();
+void journal_close(int unit);
+
+// Binary trace log (fbs_trace.c)
+enum trace_event
+{
+    EV_UNIT_SELECT, EV_UNIT_OFFLINE, EV_NEW_DSA, EV_INCR_DSA,
+    EV_WRITE_ERROR, EV_WRITE_DATA, EV_POWER_FAULT,
+    EV_ROTATION, EV_TRCACHE, EV_WRITER, EV_SCRUB,
+    EV_COUNT
+};
+
+#define TRACE_ARGS 7
+
+void trace_init();
+void trace_put(int ev, const uint32_t *args, int nargs);
+void trace_flush();
+
+// As FBS_LOG, but for the drum loop: queued in the trace ring, formatted
+// by the drainer thread. args are up to TRACE_ARGS integers.
+#define FBS_TRACE(group, ev, args...) \
+do { \
+    if (logmask & (group)) \
+        trace_put(ev, (uint32_t []){args}, sizeof((uint32_t []){args})/4); \
+} while (0)
+
+// DRC bus recorder (fbs_record.c), replayed by fbs_sim.c
+#define REC_MAGIC   0x43455246  // FREC
+#define REC_VERSION 1
+
+// Per sector flags
+#define REC_DSA     1       // DSA written, 19-bit shift register follows
+#define REC_CPDSA   2       // Sector read or written
+#define REC_WE      4       // WE for the next sector, word 267 follows
+#define REC_DATA    8       // 257 words written to this sector follow
+#define REC_POWER   16      // +25V lost
+#define REC_HDR     128     // Header, in the ring only
+
+struct rec_hdr
+{
+    uint32_t magic;
+    uint32_t version;
+    uint32_t sr;            // Unit and DSA after the first rotation
+    uint32_t we;            // ... and WE for the next sector
+    uint32_t w267;
+    uint32_t segs[MAXUNITS];
+};
+
+extern int recording;
+
+void record_init();
+void record_start(int unit, uint32_t dsa, int we, uint32_t w267);
+void record_dsa(uint32_t sr);
+void record_sector(uint32_t *wbuf, int accessed, int we, uint32_t w267, int power_fault);
+void record_stop();
+
+// Rotation-end tasks (fbs_sched.c)
+void sched_init();
+void sched_run(uint32_t t_start, uint32_t slack, int idle);
+void sched_report();
+
+// Real-time mode, clock and latency histograms (fbs_rt.c)
+enum { H_ROTATION, H_WINDOW, H_FETCH, H_FLUSH, H_POLLDSA, H_ENCODE, H_PHASES };
+
+extern int hist_on;
+extern int tick_pmu;
+
+uint32_t clock_ticks();
+uint32_t ticks_ns(uint32_t ticks);
+uint32_t ns_ticks(uint32_t ns);
+void rt_init();
+void rt_lock();
+void rt_background();
+void hist_add(int h, uint32_t ticks);
+void hist_dump();
+void hist_poll();
+
+// Cycle counter where user mode can read one, else CLOCK_MONOTONIC ns
+static inline uint32_t fbs_ticks()
+{
+#if defined(__arm__)
+    uint32_t t;
+
+    if (!tick_pmu)
+        return clock_ticks();
+    asm volatile("mrc p15, 0, %0, c9, c13, 0" : "=r"(t));    // PMCCNTR
+    return t;
+#elif defined(__x86_64__) || defined(__i386__)
+    return (uint32_t)__builtin_ia32_rdtsc();
+#else
+    return clock_ticks();
+#endif
+}
+
+#define HIST_START(t) \
+do { \
+    if (hist_on) (t) = fbs_ticks(); \
+} while (0)
+
+#define HIST_END(h, t) \
+do { \
+    if (hist_on) hist_add((h), fbs_ticks() - (t)); \
+} while (0)
+
+#endif
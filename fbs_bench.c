@@ -0,0 +1,444 @@
+// FBS4000 - Future Backing Storage for RC4000 w. DRC401 and a BeagleBone (tm)
+// Micro-benchmarks for the drum loop kernels
+//
+// fbs_bench [-n iters] [-r runs] [-j file]
+//
+// Runs against the memory-backed GPIO stub, pinned to FBS_CPU (default 0),
+// SCHED_FIFO with FBS_RT. Every benchmark is run once to warm up, then
+// runs times; ns per op is reported as min/median/max over the runs, and
+// with -j written as JSON. 'make bench' writes bench.json.
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <unistd.h>
+#include <math.h>
+#include <time.h>
+#include "fbs.h"
+
+#define WORD_RUNS   5
+#define WORDS       (4*257*WORD_RUNS)
+#define TRACKS      64      // Bench image, more than the track cache
+#define MAXRES      32
+
+struct result
+{
+    char name[32];
+    char *unit;
+    double min, median, max;
+};
+
+static struct result results[MAXRES];
+static int nres;
+static int runs = 7;
+
+static uint32_t *image;
+static struct sector_kernel *kern;
+static volatile uint32_t sink;
+
+static double now_ns()
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1e9 + ts.tv_nsec;
+}
+
+static int cmp_double(const void *a, const void *b)
+{
+    return *(double *)a < *(double *)b ? -1 : *(double *)a > *(double *)b;
+}
+
+static void bench(char *name, char *unit, double (*fn)(int), int n)
+{
+    // fn does n ops and returns the ns they took
+    double t[runs];
+    struct result *r = &results[nres];
+
+    fn(n/10 + 1);   // Warm up caches and branch predictors
+    for (int run=0; run<runs; run++)
+        t[run] = fn(n) / n;
+    qsort(t, runs, sizeof(double), cmp_double);
+    if (nres < MAXRES)
+    {
+        snprintf(r->name, sizeof(r->name), "%s", name);
+        r->unit = unit;
+        r->min = t[0];
+        r->median = t[runs/2];
+        r->max = t[runs-1];
+        nres++;
+    }
+    printf("%-24s %10.1f %10.1f %10.1f  %s\n", name, t[0], t[runs/2], t[runs-1], unit);
+}
+
+// Sector kernels
+
+static uint32_t file[4][192];
+static uint32_t trb[4][256];
+
+static double op_encode(int n)
+{
+    uint32_t parity = 0;
+    double t = now_ns();
+
+    for (int i=0; i<n; i++)
+        parity ^= kern->encode(trb[i&3], file[i&3], parity);
+    t = now_ns() - t;
+    sink = parity;
+    return t;
+}
+
+static double op_decode(int n)
+{
+    double t = now_ns();
+
+    for (int i=0; i<n; i++)
+        kern->decode(file[i&3], trb[i&3]);
+    return now_ns() - t;
+}
+
+static void bench_kernels(int iters)
+{
+    // ns per sector for encode (fetch_track) and decode (writer)
+    uint32_t x = 4000;
+    char name[32];
+
+    for (int i=0; i<4*192; i++)
+    {
+        x ^= x << 13;
+        x ^= x >> 17;
+        x ^= x << 5;
+        file[i/192][i%192] = x;
+    }
+    for (kern = sector_kernels; kern->name; kern++)
+    {
+        if (!kernel_check(kern))
+        {
+            printf("%-24s not available\n", kern->name);
+            continue;
+        }
+        snprintf(name, sizeof(name), "encode.%s", kern->name);
+        bench(name, "ns/sector", op_encode, iters);
+        snprintf(name, sizeof(name), "decode.%s", kern->name);
+        bench(name, "ns/sector", op_decode, iters);
+    }
+}
+
+// Track cache and writer
+
+static double op_fetch_hit(int n)
+{
+    double t;
+
+    dsa = 0;
+    fetch_track();
+    t = now_ns();
+    for (int i=0; i<n; i++)
+        fetch_track();
+    return now_ns() - t;
+}
+
+static double op_fetch_miss(int n)
+{
+    // Cycling through more tracks than the cache holds, LRU always misses
+    double t = now_ns();
+
+    for (int i=0; i<n; i++)
+    {
+        dsa = (i % TRACKS) << 2;
+        fetch_track();
+    }
+    t = now_ns() - t;
+    dsa = 0;
+    fetch_track();
+    for (int sect=0; sect<4; sect++)
+        track_sector(sect);
+    return t;
+}
+
+static double op_track_sector(int n)
+{
+    // Lazy encode of the sectors of a track just fetched
+    double t = 0, t0;
+
+    for (int i=0; i<n; i+=4)
+    {
+        dsa = ((i/4) % TRACKS) << 2;
+        fetch_track();
+        t0 = now_ns();
+        for (int sect=0; sect<4; sect++)
+            track_sector(sect);
+        t += now_ns() - t0;
+    }
+    dsa = 0;
+    fetch_track();
+    for (int sect=0; sect<4; sect++)
+        track_sector(sect);
+    return t;
+}
+
+static double op_flush(int n)
+{
+    // Four dirty sectors queued for the writer; the writer is drained
+    // outside the timing
+    double t = 0, t0;
+
+    dsa = 0;
+    fetch_track();
+    for (int i=0; i<n; i++)
+    {
+        for (int sect=0; sect<4; sect++)
+            dirty[sect] = 1;
+        t0 = now_ns();
+        flush_track();
+        t += now_ns() - t0;
+        if ((i & 7) == 7)
+            writer_drain();
+    }
+    writer_drain();
+    return t;
+}
+
+static double op_parity(int n)
+{
+    // Write check and trbuf update of a received sector
+    uint32_t wbuf[4][258];
+    uint32_t addr[4];
+    int ok = 0;
+    double t;
+
+    for (int sect=0; sect<4; sect++)
+    {
+        addr[sect] = trbuf[sect*SECT_WORDS + 258];
+        memcpy(wbuf[sect], trbuf + sect*SECT_WORDS, 257*4);
+        wbuf[sect][257] = wbuf[sect][256] ^ addr[sect];
+    }
+    t = now_ns();
+    for (int i=0; i<n; i++)
+        ok += write_sector(i&3, wbuf[i&3], addr[i&3]);
+    t = now_ns() - t;
+    if (ok != n)
+        printf("write_sector: parity error\n");
+    for (int sect=0; sect<4; sect++)
+        dirty[sect] = 0;
+    return t;
+}
+
+// Bit-serial loops against the GPIO stub
+
+static double op_send_words(int n)
+{
+    uint32_t wbuf[258];
+    double t = now_ns();
+
+    for (int i=0; i<n; i++)
+        send_rcv_words(trbuf + (i&3)*SECT_WORDS, 257, wbuf);
+    return now_ns() - t;
+}
+
+static double op_send_wave(int n)
+{
+    uint32_t wbuf[258];
+    uint32_t *ptr;
+    double t = now_ns();
+
+    for (int i=0; i<n; i++)
+    {
+        ptr = trbuf + (i&3)*SECT_WORDS;
+        send_rcv_wave(ptr, track_wave(ptr), 257, wbuf);
+    }
+    return now_ns() - t;
+}
+
+static double op_do_word(int n)
+{
+    // No CPDSA or SRRQ from the stub: no seek, as in a rotation without transfers
+    uint32_t w267;
+    int accessed;
+    double t = now_ns();
+
+    for (int i=0; i<n; i++)
+        do_word_257_267(trbuf + (i&3)*SECT_WORDS + 257, (i&3) == 3, &w267, &accessed);
+    return now_ns() - t;
+}
+
+static double op_poll_dsa(int n)
+{
+    uint32_t sr = 0;
+    double t;
+
+    *gpio_datain_addr[GP_SRRQ_BANK] |= 1 << GP_SRRQ_BIT;
+    t = now_ns();
+    for (int i=0; i<n; i++)
+        poll_dsa(&sr);
+    t = now_ns() - t;
+    *gpio_datain_addr[GP_SRRQ_BANK] &= ~(1 << GP_SRRQ_BIT);
+    sink = sr;
+    return t;
+}
+
+static double op_upd_leds(int n)
+{
+    // All eight LEDs flashing
+    double t;
+
+    for (int led=0; led<8; led++)
+        blink(led, n+1);
+    t = now_ns();
+    for (int i=0; i<n; i++)
+        upd_leds();
+    return now_ns() - t;
+}
+
+static double op_upd_leds_idle(int n)
+{
+    double t;
+
+    for (int led=0; led<8; led++)
+        blink(led, 0);
+    upd_leds();
+    t = now_ns();
+    for (int i=0; i<n; i++)
+        upd_leds();
+    return now_ns() - t;
+}
+
+static void word_times(char *name, int wave)
+{
+    // Time each data word sent, against the memory-backed GPIO stub
+    static double t[WORDS];
+    uint32_t wbuf[2];
+    double t0, sum = 0, sq = 0, min = 1e30, max = 0, mean, sd;
+    int n = 0;
+
+    for (int run=0; run<WORD_RUNS; run++)
+        for (int sect=0; sect<4; sect++)
+            for (int i=0; i<257; i++)
+            {
+                uint32_t *ptr = trbuf + sect*SECT_WORDS + i;
+                t0 = now_ns();
+                if (wave)
+                    send_rcv_wave(ptr, track_wave(ptr), 1, wbuf);
+                else
+                    send_rcv_words(ptr, 1, wbuf);
+                t[n++] = now_ns() - t0;
+            }
+    for (int i=0; i<n; i++)
+    {
+        sum += t[i];
+        sq += t[i]*t[i];
+        if (t[i] < min) min = t[i];
+        if (t[i] > max) max = t[i];
+    }
+    mean = sum / n;
+    sd = sqrt(sq/n - mean*mean);
+    qsort(t, n, sizeof(double), cmp_double);
+    printf("%-8s %7.1f ns/bit  per word: min %5.0f mean %5.0f sd %6.1f p99 %5.0f max %6.0f ns\n",
+           name, mean/24, min, mean, sd, t[n*99/100], max);
+}
+
+static void bench_drum(int iters)
+{
+    // The drum loop on a memory image of TRACKS tracks
+    setenv("FBS_WAVEFORM", "1", 1);
+    gpio_init();
+    bit_init();     // Cycle-counted bit cells with FBS_BITNS
+    trcache_init();
+    writer_init();
+    if (!(image = calloc(TRACKS, 768*4)))
+        abend("bench image");
+    for (int i=0; i<TRACKS*768; i++)
+        image[i] = i * 2654435761u;
+    img[0] = image;
+    unit_segs[0] = TRACKS*4;
+    selected_unit = 0;
+
+    bench("fetch_track.hit", "ns/track", op_fetch_hit, iters);
+    bench("fetch_track.miss", "ns/track", op_fetch_miss, iters/10);
+    bench("track_sector", "ns/sector", op_track_sector, iters/10);
+    bench("flush_track", "ns/track", op_flush, iters/10);
+    bench("write_sector", "ns/sector", op_parity, iters);
+    bench("send_rcv_words", "ns/sector", op_send_words, iters/100);
+    bench("do_word_257_267", "ns/sector", op_do_word, iters/10);
+    bench("poll_dsa", "ns/dsa", op_poll_dsa, iters);
+    bench("upd_leds", "ns/call", op_upd_leds, iters);
+    bench("upd_leds.idle", "ns/call", op_upd_leds_idle, iters);
+
+    // Same track with the precompiled waveform
+    dsa = 0;
+    fetch_track();
+    for (int sect=0; sect<4; sect++)
+        track_expand();
+    bench("send_rcv_wave", "ns/sector", op_send_wave, iters/100);
+    bench("do_word_257_267.wave", "ns/sector", op_do_word, iters/10);
+
+    printf("\nwaveform %d bytes per track, %d per bit cell\n",
+           4*SECT_WORDS*WAVE_WORD*4, WAVE_CELL*4);
+    dsa = 0;
+    fetch_track();
+    word_times("computed", 0);
+    for (int sect=0; sect<4; sect++)
+        track_expand();
+    word_times("waveform", 1);
+}
+
+static void write_json(char *fname, int iters)
+{
+    FILE *f = fopen(fname, "w");
+    int cpu = atoi(getenv("FBS_CPU"));     // As rt_init() pinned it
+
+    if (!f)
+        abend("Cannot open JSON file");
+    fprintf(f, "{\n  \"cpu\": %d,\n  \"runs\": %d,\n  \"iters\": %d,\n  \"results\": [\n",
+            cpu, runs, iters);
+    for (int i=0; i<nres; i++)
+        fprintf(f, "    {\"name\": \"%s\", \"unit\": \"%s\", \"min\": %.1f, \"median\": %.1f, \"max\": %.1f}%s\n",
+                results[i].name, results[i].unit, results[i].min, results[i].median, results[i].max,
+                i < nres-1 ? "," : "");
+    fprintf(f, "  ]\n}\n");
+    fclose(f);
+}
+
+int main(int argc, char *argv[])
+{
+    int iters = 20000;
+    char *json = NULL;
+    int opt;
+
+    while ((opt = getopt(argc, argv, "n:r:j:")) != -1)
+    {
+        switch (opt)
+        {
+        case 'n':
+            iters = atoi(optarg);
+            break;
+        case 'r':
+            runs = atoi(optarg);
+            break;
+        case 'j':
+            json = optarg;
+            break;
+        default:
+            fprintf(stderr, "Usage: fbs_bench [-n iters] [-r runs] [-j file]\n");
+            return 1;
+        }
+    }
+    if (iters < 100 || runs < 1)
+    {
+        fprintf(stderr, "fbs_bench: at least 100 iterations and 1 run\n");
+        return 1;
+    }
+    setenv("FBS_CPU", "0", 0);  // Pinned, unless told otherwise
+    rt_init();
+    kernels_init();
+    rt_lock();
+
+    printf("%-24s %10s %10s %10s  (%d runs, CPU %s)\n", "", "min", "median", "max",
+           runs, getenv("FBS_CPU"));
+    bench_kernels(iters);
+    bench_drum(iters);
+    if (json)
+        write_json(json, iters);
+    return 0;
+}
@@ -0,0 +1,691 @@
+// FBS4000 - Future Backing Storage for RC4000 w. DRC401 and a BeagleBone (tm)
+// Unit images: flat files, or a read-only base with a copy-on-write overlay
+//
+// A flat image is mapped read/write. With UNITn_OVERLAY the UNITn image
+// is only read, and written tracks go to the overlay file. The overlay has a map with an
+// entry per track: the track is in the base, all zero, or in an overlay
+// slot. Slots are 4 KB, page aligned, allocated on the first write to a
+// track; the file is sparse, so unused slots take no disk space and
+// untouched or zero tracks no memory. Several units can share a base.
+//
+// The drum loop reads tracks through img_track(), the writer thread
+// stores sectors with img_store_sector().
+//
+// Images are not populated when mapped. img_prefault() touches the tracks
+// the drum starts on, a background thread the rest of the flat images.
+//
+// With UNITn_IO=pwrite (or direct, for O_DIRECT) a flat image is read into
+// anonymous memory instead, so the kernel does not write back 4 KB pages
+// on its own. Stores mark FBS_IO_KB blocks dirty. The writer thread
+// writes them FBS_IO_MS after the first store, or at img_sync(). A run of
+// dirty blocks goes out as one aligned write, but never across an
+// FBS_ERASE_KB erase block boundary. Runs apart by no more than
+// FBS_IO_GAP_KB of clean blocks (default 16) are written as one, the
+// clean blocks between them included: one write of a little more, rather
+// than two.
+//
+// A drum format image (struct drum_hdr, made by fbsimg) holds the tracks
+// as sent on the DRC bus, 4*268 words with parity and address words. The
+// track cache copies sectors from it and the writer copies them back, no
+// encoding or decoding. img_track() is for packed images only.
+
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <sys/resource.h>
+#include <sys/syscall.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include "fbs.h"
+
+#define OVL_MAGIC       "FBS4OVL"
+#define OVL_VERSION     1
+#define OVL_SLOT_SIZE   4096        // Track: 3072 bytes, page aligned
+#define OVL_BASE        0           // Map entries
+#define OVL_ZERO        1
+#define OVL_SLOT        2           // Slot n: OVL_SLOT+n
+
+struct ovl_hdr
+{
+    char magic[8];
+    uint32_t version;
+    uint32_t tracks;
+    uint32_t hdr_size;  // Header and map, slots follow
+    uint32_t slots;     // Allocated, some may be free
+    uint32_t map[];
+};
+
+struct unit_img
+{
+    int fd;
+    int ofd;                // Overlay, -1: none
+    struct ovl_hdr *ovl;    // NULL: flat image
+    size_t ovl_size;
+    uint8_t *slot0;
+    uint32_t *free;         // Free slots
+    uint32_t nfree;
+    int io;                 // IO_*
+    int dfd;                // O_DIRECT, -1: none
+    int rfd;                // Scrubber reads, past the page cache, -1: none
+    int orfd;               // ... of the overlay
+    size_t size;            // Image file
+    uint8_t *dirty;         // Per io_block, explicit I/O
+    uint32_t ndirty;
+    uint32_t first;         // clock_ticks() of the first store after a write
+    uint32_t *drum;         // Track 0 of a drum format image, NULL: packed
+    pthread_mutex_t lock;   // Writer thread and img_sync()
+};
+
+enum { IO_MMAP, IO_PWRITE, IO_DIRECT };
+
+static struct unit_img units[MAXUNITS];
+static const uint32_t zerotrack[768];
+
+static size_t io_block = 16*1024;
+static size_t erase_block = 256*1024;
+static size_t io_gap = 16*1024;     // Clean blocks written along, at most
+static uint32_t io_ms = 100;
+struct img_stats imgstat;
+
+static pthread_t prefault_tid;
+static int prefault_running;
+static _Atomic int prefault_stop;
+
+static int card_open(char *name)
+{
+    // Read-only fd for img_read_card(), O_DIRECT where the file system has it
+    int fd;
+
+    if (!sum_on)
+        return -1;
+    if ((fd = open(name, O_RDONLY|O_DIRECT)) < 0 && (fd = open(name, O_RDONLY)) < 0)
+        abend("Cannot open image for scrubbing");
+    return fd;
+}
+
+static void ovl_open(int unit, char *oname)
+{
+    // Map the overlay, create it if it does not exist
+    struct unit_img *u = &units[unit];
+    uint32_t tracks = unit_segs[unit] / 4;
+    uint32_t hdr_size = (sizeof(struct ovl_hdr) + tracks*4 + OVL_SLOT_SIZE-1) & ~(OVL_SLOT_SIZE-1);
+    struct stat sb;
+    uint8_t *used;
+    int fresh;
+
+    if ((u->ofd = open(oname, O_RDWR | O_CREAT, 0644)) < 0)
+    {
+        fprintf(stderr, "Cannot open overlay: %s\n", oname);
+        exit(1);
+    }
+    u->orfd = card_open(oname);
+    if (fstat(u->ofd, &sb) == -1)
+        abend("fstat, overlay");
+    fresh = sb.st_size == 0;
+    u->ovl_size = hdr_size + (size_t)tracks*OVL_SLOT_SIZE;
+    if (fresh && ftruncate(u->ofd, u->ovl_size))
+        abend("ftruncate, overlay");
+    if (!fresh && sb.st_size != u->ovl_size)
+        abend("Overlay does not match base image");
+    u->ovl = mmap(NULL, u->ovl_size, PROT_READ|PROT_WRITE, MAP_SHARED, u->ofd, 0);
+    if (u->ovl == MAP_FAILED)
+        abend("mmap, overlay");
+    if (fresh)
+    {
+        memcpy(u->ovl->magic, OVL_MAGIC, 8);
+        u->ovl->version = OVL_VERSION;
+        u->ovl->tracks = tracks;
+        u->ovl->hdr_size = hdr_size;
+        u->ovl->slots = 0;
+    }
+    else if (memcmp(u->ovl->magic, OVL_MAGIC, 8) || u->ovl->version != OVL_VERSION ||
+             u->ovl->tracks != tracks || u->ovl->hdr_size != hdr_size)
+        abend("Overlay does not match base image");
+    u->slot0 = (uint8_t *)u->ovl + hdr_size;
+
+    // Slots not in the map are free
+    u->free = malloc(tracks*4);
+    used = calloc(tracks, 1);
+    if (!u->free || !used)
+        abend("ovl_open");
+    for (uint32_t t=0; t<tracks; t++)
+        if (u->ovl->map[t] >= OVL_SLOT)
+            used[u->ovl->map[t] - OVL_SLOT] = 1;
+    u->nfree = 0;
+    for (uint32_t i=0; i<u->ovl->slots; i++)
+        if (!used[i])
+            u->free[u->nfree++] = i;
+    free(used);
+    FBS_LOG(G_MISC, "Unit %d: overlay %s, %u of %u tracks written",
+            unit, oname, u->ovl->slots - u->nfree, tracks);
+}
+
+static void io_params()
+{
+    char *par;
+
+    if ((par = getenv("FBS_IO_KB")) != NULL)
+        io_block = strtoul(par, NULL, 0) * 1024;
+    if ((par = getenv("FBS_ERASE_KB")) != NULL)
+        erase_block = strtoul(par, NULL, 0) * 1024;
+    if ((par = getenv("FBS_IO_GAP_KB")) != NULL)
+        io_gap = strtoul(par, NULL, 0) * 1024;
+    if ((par = getenv("FBS_IO_MS")) != NULL)
+        io_ms = atoi(par);
+    if (io_block < 4096 || (io_block & (io_block-1)) ||
+        erase_block < io_block || erase_block % io_block)
+        abend("FBS_IO_KB: power of 2, at least 4, FBS_ERASE_KB a multiple of it");
+}
+
+static void io_open(int unit, char *fname, int io)
+{
+    // Read the image into anonymous memory, written back by io_flush()
+    struct unit_img *u = &units[unit];
+    size_t len = (u->size + erase_block-1) & ~(erase_block-1);
+    ssize_t n;
+
+    if (io == IO_DIRECT && (u->dfd = open(fname, O_WRONLY|O_DIRECT)) < 0)
+        abend("Cannot open image with O_DIRECT");
+    img[unit] = mmap(NULL, len, PROT_READ|PROT_WRITE, MAP_PRIVATE|MAP_ANONYMOUS, -1, 0);
+    if (img[unit] == MAP_FAILED)
+        abend("mmap, image");
+    for (size_t ofs=0; ofs<u->size; ofs+=n)
+        if ((n = pread(u->fd, (uint8_t *)img[unit] + ofs, u->size-ofs, ofs)) <= 0)
+            abend("read, image");
+    if (!(u->dirty = calloc(len / io_block, 1)))
+        abend("io_open");
+    u->io = io;
+    FBS_LOG(G_MISC, "Unit %d: %s, %zu KB writes, %zu KB erase blocks", unit,
+            io == IO_DIRECT ? "O_DIRECT" : "pwrite", io_block/1024, erase_block/1024);
+}
+
+static void io_pwrite(int fd, uint8_t *p, size_t len, size_t ofs)
+{
+    ssize_t n;
+
+    for (; len; p+=n, ofs+=n, len-=n)
+    {
+        if ((n = pwrite(fd, p, len, ofs)) <= 0)
+            abend("pwrite, image");
+        imgstat.written += n;
+        imgstat.writes++;
+    }
+}
+
+static void io_write(struct unit_img *u, uint8_t *mem, size_t ofs, size_t len)
+{
+    // Aligned write of mem[ofs..ofs+len]. With O_DIRECT the tail of the
+    // file, not a multiple of 4 KB, is written buffered.
+    size_t tail = 0;
+
+    if (ofs + len > u->size)
+        len = u->size - ofs;
+    if (u->dfd >= 0)
+    {
+        tail = len & 4095;
+        len -= tail;
+    }
+    io_pwrite(u->dfd >= 0 ? u->dfd : u->fd, mem + ofs, len, ofs);
+    io_pwrite(u->fd, mem + ofs + len, tail, ofs + len);
+}
+
+static void io_flush(int unit)
+{
+    // Dirty blocks to the file, a write per run within an erase block
+    struct unit_img *u = &units[unit];
+    uint32_t per_erase = erase_block / io_block;
+    uint32_t max_gap = io_gap / io_block;
+    uint32_t nblocks = (u->size + io_block-1) / io_block;
+    uint32_t first, last;
+
+    for (uint32_t eb=0; eb<nblocks && u->ndirty; eb+=per_erase)
+    {
+        first = last = UINT32_MAX;
+        for (uint32_t b=eb; b<eb+per_erase && b<nblocks; b++)
+        {
+            if (!u->dirty[b])
+                continue;
+            if (first != UINT32_MAX && b - last - 1 > max_gap)
+            {
+                io_write(u, (uint8_t *)img[unit], first*io_block, (last-first+1)*io_block);
+                first = UINT32_MAX;
+            }
+            if (first == UINT32_MAX)
+                first = b;
+            last = b;
+            u->dirty[b] = 0;
+            u->ndirty--;
+        }
+        if (first != UINT32_MAX)
+            io_write(u, (uint8_t *)img[unit], first*io_block, (last-first+1)*io_block);
+    }
+}
+
+static void img_flush_due()
+{
+    // Writer thread, idle: write back explicit I/O units stored to
+    // FBS_IO_MS ago
+    struct unit_img *u;
+
+    for (int unit=0; unit<MAXUNITS; unit++)
+    {
+        u = &units[unit];
+        if (!img[unit] || u->io == IO_MMAP || !u->ndirty ||
+            clock_ticks() - u->first < io_ms*1000000u)
+            continue;
+        pthread_mutex_lock(&u->lock);
+        io_flush(unit);
+        pthread_mutex_unlock(&u->lock);
+    }
+}
+
+void img_idle()
+{
+    // Writer thread, nothing to store, about every ms
+    static unsigned n;
+
+    img_flush_due();
+    sum_scrub();
+    if (++n % 8 == 0)
+        img_writeback();
+}
+
+static int drum_open(int unit, int overlay)
+{
+    // Map the image if it is in drum format
+    struct unit_img *u = &units[unit];
+    struct drum_hdr h;
+
+    u->drum = NULL;
+    if (pread(u->fd, &h, sizeof(h), 0) != sizeof(h) || memcmp(h.magic, DRUM_MAGIC, 8))
+        return 0;
+    if (h.version != DRUM_VERSION || h.track_words != DRUM_TRACK_WORDS || !h.tracks ||
+        u->size != DRUM_HDR_SIZE + (size_t)h.tracks*DRUM_TRACK_WORDS*4)
+        abend("Drum format image: bad header or size");
+    if (overlay)
+        abend("Drum format image: no overlay");
+    img[unit] = mmap(NULL, u->size, PROT_READ|PROT_WRITE, MAP_SHARED, u->fd, 0);
+    if (img[unit] == MAP_FAILED)
+        abend("mmap");
+    unit_segs[unit] = h.tracks * 4;
+    u->drum = img[unit] + DRUM_HDR_SIZE/4;
+    u->ofd = -1;
+    u->ovl = NULL;
+    FBS_LOG(G_MISC, "Unit %d: drum format, %u tracks", unit, h.tracks);
+    return 1;
+}
+
+void img_open(int unit, char *fname, char *oname, char *io)
+{
+    // Map image fname, read-only if it has an overlay oname.
+    // io: NULL, "mmap", "pwrite" or "direct"
+    struct unit_img *u = &units[unit];
+    struct stat sb;
+    int mode = IO_MMAP;
+
+    if (io && !strcmp(io, "pwrite"))
+        mode = IO_PWRITE;
+    else if (io && !strcmp(io, "direct"))
+        mode = IO_DIRECT;
+    else if (io && strcmp(io, "mmap"))
+        abend("UNITn_IO: mmap, pwrite or direct");
+    if (mode != IO_MMAP && oname)
+        abend("UNITn_IO: not with an overlay");
+    if ((u->fd = open(fname, oname ? O_RDONLY : mode != IO_MMAP ? O_RDWR : O_RDWR|O_SYNC)) < 0)
+    {
+        fprintf(stderr, "File not found: %s\n", fname);
+        exit(1);
+    }
+    if (fstat(u->fd, &sb)== -1)
+        abend("fstat");
+    if (sb.st_size < 768*4) // At least one track...
+        abend("filesize");
+    unit_segs[unit] = sb.st_size / 768;
+    u->size = sb.st_size;
+    u->io = IO_MMAP;
+    u->dfd = -1;
+    u->rfd = card_open(fname);
+    u->orfd = -1;
+    u->ndirty = 0;
+    pthread_mutex_init(&u->lock, NULL);
+    if (mode != IO_MMAP && drum_open(unit, 0))
+        abend("UNITn_IO: not with a drum format image");
+    if (mode != IO_MMAP)
+    {
+        io_params();
+        io_open(unit, fname, mode);
+    }
+    else if (drum_open(unit, oname != NULL))
+        return;
+    else if (oname)
+        img[unit] = mmap(NULL, sb.st_size, PROT_READ, MAP_SHARED, u->fd, 0);
+    else
+        img[unit] = mmap(NULL, sb.st_size, PROT_READ|PROT_WRITE, MAP_SHARED, u->fd, 0);
+    if (img[unit] == MAP_FAILED)
+        abend("mmap");
+    u->ofd = -1;
+    u->ovl = NULL;
+    if (oname)
+        ovl_open(unit, oname);
+}
+
+void img_close(int unit)
+{
+    struct unit_img *u = &units[unit];
+
+    img_prefault_stop();
+    if (u->io != IO_MMAP)
+    {
+        img_sync(unit);
+        munmap(img[unit], (u->size + erase_block-1) & ~(erase_block-1));
+        free(u->dirty);
+        if (u->dfd >= 0)
+            close(u->dfd);
+        u->io = IO_MMAP;
+    }
+    else
+        munmap(img[unit], u->size);
+    u->drum = NULL;
+    close(u->fd);
+    if (u->rfd >= 0)
+        close(u->rfd);
+    if (u->ovl)
+    {
+        munmap(u->ovl, u->ovl_size);
+        close(u->ofd);
+        if (u->orfd >= 0)
+            close(u->orfd);
+        free(u->free);
+        u->ovl = NULL;
+        u->ofd = -1;
+    }
+    img[unit] = NULL;
+    unit_segs[unit] = 0;
+}
+
+const uint32_t *img_track(int unit, uint32_t track)
+{
+    // File data of a track, 768 words. NULL for a drum format image.
+    struct unit_img *u = &units[unit];
+    uint32_t m;
+
+    if (u->drum)
+        return NULL;
+    if (!u->ovl)
+        return img[unit] + track*768;
+    m = u->ovl->map[track];
+    if (m == OVL_BASE)
+        return img[unit] + track*768;
+    if (m == OVL_ZERO)
+        return zerotrack;
+    return (uint32_t *)(u->slot0 + (size_t)(m - OVL_SLOT)*OVL_SLOT_SIZE);
+}
+
+const uint32_t *img_drum_track(int unit, uint32_t track)
+{
+    // Encoded track of a drum format image, 4*268 words, else NULL
+    struct unit_img *u = &units[unit];
+
+    return u->drum ? u->drum + track*DRUM_TRACK_WORDS : NULL;
+}
+
+int img_read_card(int unit, uint32_t track, uint32_t *buf)
+{
+    // Writer thread: the track as the file has it on the card, what
+    // img_track() or img_drum_track() has in memory, into buf. 0 if the
+    // file does not have it: stored and not yet written back (explicit
+    // I/O), or a zero overlay track. -1 if it cannot be read.
+    static uint8_t *bounce;     // Aligned for O_DIRECT
+    struct unit_img *u = &units[unit];
+    size_t len = u->drum ? DRUM_TRACK_WORDS*4 : 768*4;
+    off_t pos = (u->drum ? DRUM_HDR_SIZE : 0) + (off_t)track*len;
+    off_t start = pos & ~4095;
+    size_t n = (pos - start + len + 4095) & ~4095;
+    int fd = u->rfd;
+    int ok;
+
+    if (!bounce && posix_memalign((void **)&bounce, 4096, 3*4096))
+        abend("img_read_card");
+    if (u->ovl && u->ovl->map[track] == OVL_ZERO)
+        return 0;
+    if (u->ovl && u->ovl->map[track] != OVL_BASE)
+    {
+        fd = u->orfd;
+        pos = (u->slot0 - (uint8_t *)u->ovl) + (off_t)(u->ovl->map[track] - OVL_SLOT)*OVL_SLOT_SIZE;
+        start = pos & ~4095;
+        n = (pos - start + len + 4095) & ~4095;
+    }
+    if (fd < 0)
+        return 0;
+    pthread_mutex_lock(&u->lock);
+    if (u->io != IO_MMAP && (u->dirty[pos / io_block] || u->dirty[(pos + len-1) / io_block]))
+    {
+        pthread_mutex_unlock(&u->lock);
+        return 0;
+    }
+    // Without O_DIRECT: drop the cached pages first, as far as they are
+    // not mapped. With it, dirty pages are written back before the read.
+    posix_fadvise(fd, start, n, POSIX_FADV_DONTNEED);
+    ok = pread(fd, bounce, n, start) >= pos - start + len;
+    pthread_mutex_unlock(&u->lock);
+    if (!ok)
+        return -1;
+    memcpy(buf, bounce + (pos - start), len);
+    return 1;
+}
+
+void img_store_drum(int unit, uint32_t seg, const uint32_t *words)
+{
+    // Store a sector as received, 256 data words and parity
+    snap_cow(unit, seg);
+    memcpy(units[unit].drum + (seg>>2)*DRUM_TRACK_WORDS + (seg&3)*SECT_WORDS, words, 257*4);
+    sum_store(unit, seg);
+    repl_store(unit, seg);
+}
+
+static int track_zero(const uint32_t *p)
+{
+    for (int i=0; i<768; i++)
+        if (p[i])
+            return 0;
+    return 1;
+}
+
+static void store_sector(int unit, uint32_t seg, const uint32_t *data)
+{
+    // Store a sector (192 words), in the overlay: allocate the track's
+    // slot on the first write, release it if the track is all zero
+    struct unit_img *u = &units[unit];
+    uint32_t track = seg >> 2;
+    uint32_t slot;
+    uint32_t *p;
+
+    if (u->drum)
+    {   // Journal replay
+        p = u->drum + track*DRUM_TRACK_WORDS + (seg&3)*SECT_WORDS;
+        p[256] = encode_sector(p, data, ((((track<<2) & 0x7FC) + (seg&3)) << 8) | 0x80000000);
+        return;
+    }
+    if (!u->ovl)
+    {
+        if (u->io != IO_MMAP)
+            pthread_mutex_lock(&u->lock);
+        memcpy(img[unit] + seg*(768/4), data, 768);
+        if (u->io != IO_MMAP)
+        {
+            uint32_t b = (size_t)seg*768 / io_block;
+
+            if (!u->ndirty)
+                u->first = clock_ticks();
+            u->ndirty += !u->dirty[b];
+            u->dirty[b] = 1;
+            if ((size_t)(seg+1)*768 > (size_t)(b+1)*io_block)
+            {   // Sector across two blocks
+                u->ndirty += !u->dirty[b+1];
+                u->dirty[b+1] = 1;
+            }
+            imgstat.dirtied += 768;
+            pthread_mutex_unlock(&u->lock);
+        }
+        return;
+    }
+    if (u->ovl->map[track] < OVL_SLOT)
+    {
+        if (track_zero(data) && img_track(unit, track) == zerotrack)
+            return;
+        slot = u->nfree ? u->free[--u->nfree] : u->ovl->slots++;
+        p = (uint32_t *)(u->slot0 + (size_t)slot*OVL_SLOT_SIZE);
+        memcpy(p, img_track(unit, track), 768*4);
+        memcpy(p + (seg&3)*(768/4), data, 768);
+        u->ovl->map[track] = slot + OVL_SLOT;
+    }
+    else
+    {
+        slot = u->ovl->map[track] - OVL_SLOT;
+        p = (uint32_t *)(u->slot0 + (size_t)slot*OVL_SLOT_SIZE);
+        memcpy(p + (seg&3)*(768/4), data, 768);
+    }
+    if (track_zero(p))
+    {
+        u->ovl->map[track] = OVL_ZERO;
+        fallocate(u->ofd, FALLOC_FL_PUNCH_HOLE | FALLOC_FL_KEEP_SIZE,
+                  (uint8_t *)p - (uint8_t *)u->ovl, OVL_SLOT_SIZE);
+        u->free[u->nfree++] = slot;
+    }
+}
+
+void img_store_sector(int unit, uint32_t seg, const uint32_t *data)
+{
+    snap_cow(unit, seg);
+    store_sector(unit, seg, data);
+    sum_store(unit, seg);
+    repl_store(unit, seg);
+}
+
+void img_sync(int unit)
+{
+    // Stored sectors to disk
+    struct unit_img *u = &units[unit];
+
+    if (u->io != IO_MMAP)
+    {
+        pthread_mutex_lock(&u->lock);
+        io_flush(unit);
+        pthread_mutex_unlock(&u->lock);
+        if (fdatasync(u->fd) || (u->dfd >= 0 && fdatasync(u->dfd)))
+            abend("fdatasync, image");
+    }
+    else if (u->ovl)
+    {
+        if (msync(u->ovl, u->ovl_size, MS_SYNC))
+            abend("msync, overlay");
+    }
+    else if (msync(img[unit], u->size, MS_SYNC))
+        abend("msync");
+    sum_sync(unit);
+}
+
+void img_writeback()
+{
+    // Start writeback of the next 256 KB of an image, round robin, so
+    // img_sync() at power off has little left to do. Does not wait.
+    static int unit;
+    static off_t ofs;
+    struct unit_img *u;
+    off_t size;
+
+    for (int i=0; i<MAXUNITS && !img[unit]; i++)
+    {
+        unit = (unit+1) % MAXUNITS;
+        ofs = 0;
+    }
+    if (!img[unit] || units[unit].io != IO_MMAP)
+        return;     // Explicit I/O: the writer thread writes
+    u = &units[unit];
+    size = u->ovl ? u->ovl_size : u->size;
+    sync_file_range(u->ovl ? u->ofd : u->fd, ofs, 256*1024, SYNC_FILE_RANGE_WRITE);
+    if ((ofs += 256*1024) >= size)
+    {
+        unit = (unit+1) % MAXUNITS;
+        ofs = 0;
+    }
+}
+
+static uint32_t touch(const void *p, size_t len)
+{
+    // Fault in the pages of p..p+len
+    const volatile uint8_t *b = p;
+    uint32_t x = 0;
+
+    for (size_t i=0; i<len; i+=4096)
+        x += b[i];
+    return x + b[len-1];
+}
+
+void img_prefault(int tracks)
+{
+    // First tracks of every unit, where the drum starts after power on
+    uint32_t n;
+
+    for (int unit=0; unit<MAXUNITS; unit++)
+    {
+        if (!img[unit])
+            continue;
+        n = unit_segs[unit] / 4;
+        for (uint32_t t=0; t<n && t<tracks; t++)
+            if (units[unit].drum)
+                touch(img_drum_track(unit, t), DRUM_TRACK_WORDS*4);
+            else
+                touch(img_track(unit, t), 768*4);
+    }
+}
+
+static void *prefault(void *arg)
+{
+    // Rest of the flat images, at low priority. Overlay units only
+    // fault in the tracks the drum reads.
+    uint32_t t0 = clock_ticks();
+    size_t size;
+
+    rt_background();
+    setpriority(PRIO_PROCESS, syscall(SYS_gettid), 19);
+    for (int unit=0; unit<MAXUNITS; unit++)
+    {
+        if (!img[unit] || units[unit].ovl || units[unit].io != IO_MMAP)
+            continue;
+        size = units[unit].size;
+        for (size_t ofs=0; ofs<size; ofs+=64*1024)
+        {
+            if (atomic_load(&prefault_stop))
+                return NULL;
+            touch((uint8_t *)img[unit] + ofs, size-ofs < 64*1024 ? size-ofs : 64*1024);
+        }
+    }
+    FBS_LOG(G_MISC, "Images prefaulted in %u ms", (clock_ticks() - t0) / 1000000);
+    return NULL;
+}
+
+void img_prefault_bg()
+{
+    img_prefault_stop();
+    atomic_store(&prefault_stop, 0);
+    if (pthread_create(&prefault_tid, NULL, prefault, NULL))
+        abend("pthread_create, prefault");
+    prefault_running = 1;
+}
+
+void img_prefault_stop()
+{
+    // Images are about to be unmapped
+    if (!prefault_running)
+        return;
+    atomic_store(&prefault_stop, 1);
+    pthread_join(prefault_tid, NULL);
+    prefault_running = 0;
+}
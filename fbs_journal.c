@@ -0,0 +1,173 @@
+// FBS4000 - Future Backing Storage for RC4000 w. DRC401 and a BeagleBone (tm)
+// Write-ahead journal of accepted sectors
+//
+// With FBS_JOURNAL=1 every unit image gets a journal <image>.jnl. The
+// writer thread appends each sector it is about to store, with a CRC,
+// and calls fdatasync() for a whole batch at once (group commit): when
+// FBS_JOURNAL_BATCH sectors are waiting, when the oldest has waited
+// FBS_JOURNAL_MS, or when the drum loop waits for the writer. Only then
+// are the sectors stored in the mapped image, so a sector in the image
+// is always in the journal first. When the journal exceeds FBS_JOURNAL_MAX
+// KB the image is msync'ed and the journal emptied (checkpoint).
+// file_init replays what is left from a crash.
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/stat.h>
+#include "fbs.h"
+
+#define JNL_MAGIC   0x4a534246  // FBSJ
+
+struct jnl_rec
+{
+    uint32_t magic;
+    uint32_t seg;
+    uint32_t data[768/4];   // As in the image
+    uint32_t crc;           // Of seg and data
+};
+
+int journal_on = 0;
+int journal_ms = 10;
+int journal_batch = 32;
+static uint32_t journal_max = 4096*1024;
+
+static int jfd[MAXUNITS] = {-1, -1, -1, -1};
+static uint32_t jsize[MAXUNITS];
+static int unsynced[MAXUNITS];
+
+void journal_init()
+{
+    char *par;
+
+    if ((par = getenv("FBS_JOURNAL")) != NULL)
+        journal_on = atoi(par);
+    if ((par = getenv("FBS_JOURNAL_MS")) != NULL)
+        journal_ms = atoi(par);
+    if ((par = getenv("FBS_JOURNAL_BATCH")) != NULL)
+    {
+        journal_batch = atoi(par);
+        if (journal_batch < 1) abend("Error in FBS_JOURNAL_BATCH (at least 1 sector)");
+    }
+    if ((par = getenv("FBS_JOURNAL_MAX")) != NULL)
+        journal_max = strtoul(par, NULL, 0) * 1024;
+    fbs_crc32(0, NULL, 0);
+    if (journal_on)
+        FBS_LOG(G_MISC, "Journal: group commit %d sectors/%d ms, checkpoint at %u KB",
+                journal_batch, journal_ms, journal_max/1024);
+}
+
+static int replay(int unit, int fd)
+{
+    // Apply valid records to the image, stop at the first torn one
+    struct jnl_rec r;
+    int n = 0;
+
+    while (read(fd, &r, sizeof(r)) == sizeof(r))
+    {
+        if (r.magic != JNL_MAGIC ||
+            r.crc != fbs_crc32(0, &r.seg, sizeof(r.seg) + sizeof(r.data)) ||
+            r.seg >= unit_segs[unit])
+            break;
+        img_store_sector(unit, r.seg, r.data);
+        n++;
+    }
+    return n;
+}
+
+void journal_open(int unit, char *fname)
+{
+    // Replay and empty the journal of an image just mapped
+    char jname[strlen(fname) + 5];
+    int fd;
+    int n;
+
+    sprintf(jname, "%s.jnl", fname);
+    fd = open(jname, O_RDWR | O_APPEND | (journal_on ? O_CREAT : 0), 0644);
+    if (fd < 0)
+    {
+        if (journal_on)
+            abend("Cannot open journal");
+        return;
+    }
+    if ((n = replay(unit, fd)) > 0)
+    {
+        FBS_LOG(G_MISC, "Journal %s: %d sectors replayed", jname, n);
+        img_sync(unit);
+    }
+    if (ftruncate(fd, 0))
+        abend("ftruncate, journal");
+    fsync(fd);
+    if (!journal_on)
+    {
+        close(fd);
+        unlink(jname);
+        return;
+    }
+    jfd[unit] = fd;
+    jsize[unit] = 0;
+    unsynced[unit] = 0;
+}
+
+void journal_append(int unit, uint32_t seg, uint32_t *data)
+{
+    // Writer thread: log a sector, durable after journal_sync()
+    struct jnl_rec r;
+
+    if (jfd[unit] < 0)
+        return;
+    r.magic = JNL_MAGIC;
+    r.seg = seg;
+    memcpy(r.data, data, 768);
+    r.crc = fbs_crc32(0, &r.seg, sizeof(r.seg) + sizeof(r.data));
+    if (write(jfd[unit], &r, sizeof(r)) != sizeof(r))
+        abend("write, journal");
+    jsize[unit] += sizeof(r);
+    unsynced[unit] = 1;
+}
+
+void journal_sync()
+{
+    // Group commit
+    for (int unit=0; unit<MAXUNITS; unit++)
+    {
+        if (unsynced[unit])
+        {
+            if (fdatasync(jfd[unit]))
+                abend("fdatasync, journal");
+            unsynced[unit] = 0;
+        }
+    }
+}
+
+static void checkpoint(int unit)
+{
+    // Image to disk, journal emptied.
+    // Everything logged must be stored in the image.
+    img_sync(unit);
+    if (ftruncate(jfd[unit], 0))
+        abend("ftruncate, journal");
+    jsize[unit] = 0;
+}
+
+void journal_checkpoint()
+{
+    // Writer thread, after storing a batch
+    for (int unit=0; unit<MAXUNITS; unit++)
+        if (jfd[unit] >= 0 && jsize[unit] >= journal_max)
+            checkpoint(unit);
+}
+
+void journal_close(int unit)
+{
+    // Writer drained, image about to be unmapped
+    if (jfd[unit] < 0)
+        return;
+    if (jsize[unit])
+        checkpoint(unit);
+    close(jfd[unit]);
+    jfd[unit] = -1;
+}
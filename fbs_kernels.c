@@ -0,0 +1,212 @@
+// FBS4000 - Future Backing Storage for RC4000 w. DRC401 and a BeagleBone (tm)
+// Sector kernels: 32-bit file words <-> inverted 24-bit DRC words
+//
+// The scalar kernels are the reference. Where NEON is available the
+// permutes are done 4 groups (12 file words / 16 DRC words) at a time.
+// kernels_init() picks a kernel at runtime and checks it against the
+// scalar one before use.
+//
+// fbs_crc32() is here too, for the journal and the image tools.
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include "fbs.h"
+
+#if defined(__ARM_NEON) || defined(__ARM_NEON__)
+#define HAVE_NEON 1
+#include <arm_neon.h>
+#if defined(__arm__)
+#include <sys/auxv.h>
+#include <asm/hwcap.h>
+#endif
+#endif
+
+// Sector data occupies word 0..255. Reformat to 24-bit
+//    24-bit:     32-bit (file):
+//      cba0            dcba
+//      fed0            hgfe
+//      ihg0            lkji
+//      lkj0
+
+static uint32_t encode_scalar(uint32_t *trb, const uint32_t *imgptr, uint32_t parity)
+{
+    // 192 file words to 256 DRC words, returns parity ^ DRC words
+    for (int i=0; i<256/4; i++)
+    {
+        parity ^= (*(trb++) = (imgptr[0] << 8) ^ INVMASK24);
+        parity ^= (*(trb++) = ((((imgptr[0] & 0xff000000) >> 16) | (imgptr[1] << 16))) ^INVMASK24);
+        parity ^= (*(trb++) = ((((imgptr[1] & 0xffff0000) >> 8)  | (imgptr[2] << 24))) ^INVMASK24);
+        parity ^= (*(trb++) = (imgptr[2] & 0xffffff00) ^INVMASK24);
+        imgptr += 3;
+    }
+    return parity;
+}
+
+static void decode_scalar(uint32_t *imgptr, const uint32_t *trb)
+{
+    // 256 DRC words to 192 file words
+    for (int i=0; i<256/4; i++)
+    {
+        *(imgptr++) = ((trb[0] >> 8) | ((trb[1] & 0x0000ff00) << 16)) ^INVMASK32;
+        *(imgptr++) = ((trb[1] >> 16) | ((trb[2] & 0x00ffff00) << 8)) ^INVMASK32;
+        *(imgptr++) = ((trb[2] >> 24) | (trb[3] & 0xffffff00)) ^INVMASK32;
+        trb += 4;
+    }
+}
+
+#ifdef HAVE_NEON
+static uint32_t encode_neon(uint32_t *trb, const uint32_t *imgptr, uint32_t parity)
+{
+    // vld3 splits 4 groups into a/b/c lanes, vst4 interleaves the 4 results
+    uint32x4_t inv = vdupq_n_u32(INVMASK24);
+    uint32x4_t m24 = vdupq_n_u32(0xffffff00);
+    uint32x4_t par = vdupq_n_u32(0);
+    uint32x4x3_t in;
+    uint32x4x4_t out;
+
+    for (int i=0; i<256/16; i++)
+    {
+        in = vld3q_u32(imgptr);
+        out.val[0] = veorq_u32(vshlq_n_u32(in.val[0], 8), inv);
+        out.val[1] = veorq_u32(vorrq_u32(vshlq_n_u32(vshrq_n_u32(in.val[0], 24), 8),
+                                         vshlq_n_u32(in.val[1], 16)), inv);
+        out.val[2] = veorq_u32(vorrq_u32(vshlq_n_u32(vshrq_n_u32(in.val[1], 16), 8),
+                                         vshlq_n_u32(in.val[2], 24)), inv);
+        out.val[3] = veorq_u32(vandq_u32(in.val[2], m24), inv);
+        vst4q_u32(trb, out);
+        par = veorq_u32(par, veorq_u32(veorq_u32(out.val[0], out.val[1]),
+                                       veorq_u32(out.val[2], out.val[3])));
+        imgptr += 12;
+        trb += 16;
+    }
+    return parity ^ vgetq_lane_u32(par, 0) ^ vgetq_lane_u32(par, 1)
+                  ^ vgetq_lane_u32(par, 2) ^ vgetq_lane_u32(par, 3);
+}
+
+static void decode_neon(uint32_t *imgptr, const uint32_t *trb)
+{
+    uint32x4_t inv = vdupq_n_u32(INVMASK32);
+    uint32x4_t m24 = vdupq_n_u32(0xffffff00);
+    uint32x4x4_t in;
+    uint32x4x3_t out;
+
+    for (int i=0; i<256/16; i++)
+    {
+        in = vld4q_u32(trb);
+        out.val[0] = veorq_u32(vorrq_u32(vshrq_n_u32(in.val[0], 8),
+                                         vshlq_n_u32(vshrq_n_u32(in.val[1], 8), 24)), inv);
+        out.val[1] = veorq_u32(vorrq_u32(vshrq_n_u32(in.val[1], 16),
+                                         vshlq_n_u32(vshrq_n_u32(in.val[2], 8), 16)), inv);
+        out.val[2] = veorq_u32(vorrq_u32(vshrq_n_u32(in.val[2], 24),
+                                         vandq_u32(in.val[3], m24)), inv);
+        vst3q_u32(imgptr, out);
+        imgptr += 12;
+        trb += 16;
+    }
+}
+#endif
+
+struct sector_kernel sector_kernels[] =
+{
+    {"scalar", encode_scalar, decode_scalar},
+#ifdef HAVE_NEON
+    {"neon", encode_neon, decode_neon},
+#endif
+    {NULL, NULL, NULL}
+};
+
+uint32_t (*encode_sector)(uint32_t *trb, const uint32_t *imgptr, uint32_t parity) = encode_scalar;
+void (*decode_sector)(uint32_t *imgptr, const uint32_t *trb) = decode_scalar;
+
+static int kernel_available(struct sector_kernel *k)
+{
+#ifdef HAVE_NEON
+    if (k->encode == encode_neon)
+    {
+#if defined(__arm__)
+        return (getauxval(AT_HWCAP) & HWCAP_NEON) != 0;
+#else
+        return 1;
+#endif
+    }
+#endif
+    return 1;
+}
+
+int kernel_check(struct sector_kernel *k)
+{
+    // Is the kernel available on this CPU, does it match the scalar
+    // kernels and survive the round trip
+    uint32_t src[192], trb[2][256], back[2][192];
+    uint32_t par[2];
+    uint32_t x = 0x4000;
+
+    if (!kernel_available(k))
+        return 0;
+    for (int i=0; i<192; i++)
+    {   // xorshift32
+        x ^= x << 13;
+        x ^= x >> 17;
+        x ^= x << 5;
+        src[i] = x;
+    }
+    par[0] = encode_scalar(trb[0], src, 0x80000100);
+    par[1] = k->encode(trb[1], src, 0x80000100);
+    decode_scalar(back[0], trb[0]);
+    k->decode(back[1], trb[1]);
+    return par[0] == par[1] &&
+           !memcmp(trb[0], trb[1], sizeof(trb[0])) &&
+           !memcmp(back[0], src, sizeof(src)) &&
+           !memcmp(back[1], src, sizeof(src));
+}
+
+void kernels_init()
+{
+    // Fastest available kernel that passes the check, or the one in FBS_KERNEL
+    char *want = getenv("FBS_KERNEL");
+    struct sector_kernel *sel = &sector_kernels[0];
+
+    for (struct sector_kernel *k = sector_kernels; k->name; k++)
+    {
+        if (want && strcmp(want, k->name))
+            continue;
+        if (!kernel_available(k))
+            continue;
+        if (!kernel_check(k))
+        {
+            FBS_LOG(G_ERROR, "Sector kernel %s failed self test", k->name);
+            continue;
+        }
+        sel = k;
+    }
+    if (want && strcmp(want, sel->name))
+        FBS_LOG(G_ERROR, "Sector kernel %s not available", want);
+    encode_sector = sel->encode;
+    decode_sector = sel->decode;
+    FBS_LOG(G_MISC, "Sector kernel: %s", sel->name);
+}
+
+static uint32_t crc_table[256];
+
+uint32_t fbs_crc32(uint32_t crc, const void *buf, uint32_t len)
+{
+    // CRC-32 (IEEE 802.3), as zlib's crc32()
+    const uint8_t *p = buf;
+
+    if (!crc_table[1])
+    {
+        for (uint32_t i=0; i<256; i++)
+        {
+            uint32_t c = i;
+            for (int k=0; k<8; k++)
+                c = c & 1 ? 0xedb88320 ^ (c >> 1) : c >> 1;
+            crc_table[i] = c;
+        }
+    }
+    crc = ~crc;
+    while (len--)
+        crc = crc_table[(crc ^ *p++) & 0xff] ^ (crc >> 8);
+    return ~crc;
+}
@@ -14,77 +14,63 @@
 #include <string.h>
 #include <fcntl.h>
 #include <syslog.h>
+#include "fbs.h"
+#ifdef FBS_SIM
+#include "fbs_sim.h"
+#endif
 
 // #define OVERCLOCK 1
 // #define STANDALONE_TEST 1  // For timing tests on unconnected BB
 
-// ****************************
-// *** SYSLOG DEFINITIONS:  ***
-// ****************************
-
-// Mask bits for syslogging
-#define G_SEEK    1
-#define G_DATA    2
-#define G_ERROR   4
-#define G_STAT    8
-#define G_MISC  256
-
-static uint32_t logmask = G_MISC | G_STAT | G_ERROR;
-
-#define FBS_LOG(group, args...) \
-do { \
-    if (logmask & group) syslog(LOG_INFO, ##args); \
-} while (0);
-
-
-// ****************************
-// ***** FBS GPIO INPUTS: *****
-// ****************************
-
-// Input, serial output from DSA shift register
-#define GP_SRDATA_BANK      0
-#define GP_SRDATA_BIT       20
-
-// Input, Write Data from DRC
-#define GP_WRDATA_BANK      1   // SP0(0)
-#define GP_WRDATA_BIT       12
-
-// Input, Write Enable from DRC
-#define GP_WE_BANK          1
-#define GP_WE_BIT           14
+// Bit cell timing. By default a cell is three bank 2 stores, RDCLK high
+// in the first (two with OVERCLOCK), so the bit rate is what the bus
+// gives. With FBS_BITNS=<ns> the cycle counter places the edges: RDCLK
+// high at the start of the cell, low after a third of it. A late cell
+// starts the schedule over, cells are never shorter than the period.
+uint32_t bit_ticks = 0;     // Cell period, 0: store timed
+static uint32_t bit_high;   // RDCLK high
+static uint32_t cell_next;  // Start of the next cell
 
-// Input, CP_DSP, clock pulse incrementing Drum Segment Address in DRC
-#define GP_CPDSA_BANK       1
-#define GP_CPDSA_BIT        16
-
-// Input, latched G_i_First_Segment - First Segment was written to DRC by RC4000
-#define GP_SRRQ_BANK        1
-#define GP_SRRQ_BIT         17
-
-
-// *****************************
-// ***** FBS GPIO OUTPUTS: *****
-// *****************************
-
-// Output, clock to DSA shift register
-#define GP_SRCLK_BANK       0
-#define GP_SRCLK_BIT        26
+static inline uint32_t cell_wait(uint32_t t)
+{
+    // Wait for tick t, return the tick the edge is actually at
+    uint32_t now;
 
-// Output, Connected status to DRC
-#define GP_CONN_BANK        1
-#define GP_CONN_BIT         29
+    while ((int32_t)((now = fbs_ticks()) - t) < 0)
+        ;
+    return now;
+}
 
-// Output, drum index to DRC
-#define GP_INDEX_BANK       2
-#define GP_INDEX_BIT        1
+#ifdef OVERCLOCK
+#define CELL_PAD(val)
+#else
+#define CELL_PAD(val)   UPD_WAVE(val)   // For correct timing
+#endif
 
-// Output, Read Data to DRC
-#define GP_RDDATA_BANK      2
-#define GP_RDDATA_BIT       3
+// Start of a bit cell, RDCLK high
+#define CELL_HIGH(t, val) \
+do { \
+    if (bit_ticks) (t) = cell_wait(t); \
+    UPD_WAVE(val); \
+} while (0)
 
-// Output, drum clock to DRC
-#define GP_RDCLK_BANK       2
-#define GP_RDCLK_BIT        4
+// RDCLK low for the rest of the cell
+#define CELL_LOW(t, val) \
+do { \
+    if (bit_ticks) \
+    { \
+        cell_wait((t) + bit_high); \
+        UPD_WAVE(val); \
+        (t) += bit_ticks; \
+    } \
+    else \
+    { \
+        UPD_WAVE(val); \
+        CELL_PAD(val); \
+    } \
+} while (0)
+
+uint32_t logmask = G_MISC | G_STAT | G_ERROR;
 
 // LED outputs:
 
@@ -118,17 +104,6 @@ int led_banks[] = {GP_LED0_BANK, GP_LED1_BANK, GP_LED2_BANK, GP_LED3_BANK,
 int led_bits[] =  {GP_LED0_BIT, GP_LED1_BIT, GP_LED2_BIT, GP_LED3_BIT,
                    GP_LED4_BIT, GP_LED5_BIT, GP_LED6_BIT, GP_LED7_BIT};                    
 
-#define MAX_GPIO_BANKS              (4)
-
-// GPIO register size
-#define AM335X_GPIO_SIZE            0x1000
-
-#define AM335X_GPIO_OE              0x134
-#define AM335X_GPIO_DATAIN          0x138
-#define AM335X_GPIO_DATAOUT         0x13C
-#define AM335X_GPIO_CLEARDATAOUT    0x190
-#define AM335X_GPIO_SETDATAOUT      0x194
-
 #define OUT          (0)
 #define IN           (1)
 
@@ -151,16 +126,9 @@ uint32_t *gpio_cleardataout_addr[MAX_GPIO_BANKS]        = { NULL };
 
 uint32_t gpio_mirror[MAX_GPIO_BANKS];
 
-#define INVMASK24  0x66666600
-#define INVMASK32  0x66666666
-
-#define MAXUNITS 4
-
-int unit_fd[MAXUNITS];
-static uint32_t *img[MAXUNITS];
+uint32_t *img[MAXUNITS];
 uint32_t unit_segs[MAXUNITS];
 int seek_error = 0;
-int dirty[4];
 int disconnected = 0;
 uint32_t trackcnt = 0;
 
@@ -178,8 +146,13 @@ uint32_t dsa = 0;  // Drum Segment Address
 
 int rd_dlybit = 0; // Global 1-bit delay line for outgoing (read) data
 
-// Track buffer, 4*268 24-bit words
-uint32_t trbuf[4*268];
+// Power on, main() only
+#ifndef FBS_BENCH
+static int ledtest_ms = 100;    // Per LED, 0: no LED test
+static int powerpoll_ms = 1000; // +25V poll interval while off
+static int standby_us = 1000;   // ... in warm standby
+#endif
+static int prefault_tracks = 64;    // Per unit, faulted in before connecting
 
 void abend(char *s)
 {
@@ -192,7 +165,11 @@ void fbs_openlog()
 {
     char *logpar;
 
+#ifdef FBS_SIM
+    openlog("FBS4000", LOG_NDELAY | LOG_PERROR, LOG_USER);
+#else
     openlog("FBS4000", LOG_NDELAY, LOG_USER);
+#endif
     if ((logpar=getenv("FBS_LOGMASK")) != NULL)
     {
         logmask = strtoul(logpar, NULL, 16);
@@ -215,12 +192,14 @@ void gpio_set_direction(int bank, int pin, int direction)
 void gpio_set(int bank, int pin)
 {   // Not faster than write the whole mirror...
 	*gpio_setdataout_addr[bank] = (1 << pin);
+	GPIO_STORED(bank);
 	gpio_mirror[bank] |= (1 << pin);
 }
 
 void gpio_clear(int bank, int pin)
 {
 	*gpio_cleardataout_addr[bank] = (1 << pin);
+	GPIO_STORED(bank);
 	gpio_mirror[bank] &= (~(1 << pin));
 }
 
@@ -238,11 +217,9 @@ int gpio_read_pin(int bank, int pin)
 void gpio_write_bank_from_mirror(int bank)
 {
     *gpio_dataout_addr[bank] = gpio_mirror[bank];
+    GPIO_STORED(bank);
 }
 
-// Update GPIO bank 2 w. clk, data, index bits
-#define UPD_DRC *gpio_dataout_addr[2] = gpio_mirror[2]
-
 void set_led(int led, int val)
 {   // LED is on when GPIO out is low
     if (val)
@@ -269,10 +246,20 @@ void upd_leds()
     }
 }
 
-void gpio_init()
+#if defined(FBS_BENCH)
+static uint32_t gpio_mem[MAX_GPIO_BANKS][AM335X_GPIO_SIZE/4];
+
+void gpio_map()
+{
+    // Memory-backed register stub for the benchmarks
+    for (int bank=0; bank<MAX_GPIO_BANKS; bank++)
+        gpio_addr[bank] = gpio_mem[bank];
+}
+#elif !defined(FBS_SIM)
+void gpio_map()
 {
     int mem_fd;
-	int bank = 0, i;
+	int bank = 0;
 	uint32_t *config;
 	
 	/* Setup pinmux for pins that are not GPIO already */
@@ -317,12 +304,6 @@ void gpio_init()
                                 mem_fd,                 //File to map
                                 gpio_base[bank]         //Offset to GPIO peripheral
                               );
-        
-        gpio_oe_addr[bank] = gpio_addr[bank] + AM335X_GPIO_OE;             
-        gpio_datain_addr[bank] = gpio_addr[bank] + AM335X_GPIO_DATAIN;             
-        gpio_dataout_addr[bank] = gpio_addr[bank] + AM335X_GPIO_DATAOUT;             
-        gpio_setdataout_addr[bank] = gpio_addr[bank] + AM335X_GPIO_SETDATAOUT;             
-        gpio_cleardataout_addr[bank] = gpio_addr[bank] + AM335X_GPIO_CLEARDATAOUT;             
     } 
     
 	close(mem_fd); //No need to keep mem_fd open after mmap
@@ -332,6 +313,26 @@ void gpio_init()
 			exit(-1);
 		}
 	}
+} // gpio_map
+#endif
+
+void gpio_init()
+{
+	int bank = 0, i;
+
+#ifdef FBS_SIM
+    sim_gpio_map();
+#else
+    gpio_map();
+#endif
+	for (bank=0; bank<MAX_GPIO_BANKS; bank++)
+	{
+        gpio_oe_addr[bank] = gpio_addr[bank] + AM335X_GPIO_OE;             
+        gpio_datain_addr[bank] = gpio_addr[bank] + AM335X_GPIO_DATAIN;             
+        gpio_dataout_addr[bank] = gpio_addr[bank] + AM335X_GPIO_DATAOUT;             
+        gpio_setdataout_addr[bank] = gpio_addr[bank] + AM335X_GPIO_SETDATAOUT;             
+        gpio_cleardataout_addr[bank] = gpio_addr[bank] + AM335X_GPIO_CLEARDATAOUT;             
+    }
     
 	gpio_set_direction(GP_SRDATA_BANK, GP_SRDATA_BIT, IN);
 	gpio_set_direction(GP_WRDATA_BANK, GP_WRDATA_BIT, IN);
@@ -371,9 +372,12 @@ int cmd(char *cmd)
 
 void file_init()
 {
-    char uname[6];
+    char uname[14];
     char *fname;
-    struct stat sb;
+    char *oname;
+    char *io;
+    char *mirror;
+    char *snap;
     int units = 0;
     char *startcmd;
     
@@ -388,51 +392,60 @@ void file_init()
     for (int unit=0; unit<MAXUNITS; unit++)
     {
         uname[4] = unit + '0';
+        uname[5] = 0;
         fname = getenv(uname);
+        strcpy(uname+5, "_OVERLAY");    // Read-only fname, writes go here
+        oname = getenv(uname);
+        strcpy(uname+5, "_IO");         // mmap, pwrite or direct
+        io = getenv(uname);
+        strcpy(uname+5, "_MIRROR");     // File or unix:<socket>
+        mirror = getenv(uname);
+        strcpy(uname+5, "_SNAP");       // Default <image>.snap
+        snap = getenv(uname);
         if (fname)
         {
-            // unit_fd not used at present, fd could be closed after each mmap
-            if ((unit_fd[unit] = open(uname, O_RDWR|O_SYNC)) < 0)
-            {
-                fprintf(stderr, "File not found: %s\n", fname);
-                exit(1);
-            }
-            if (fstat(unit_fd[unit], &sb)== -1)
-                abend("fstat");
-            if (sb.st_size < 768*4) // At least one track...
-                abend("filesize");
-            img[unit] = mmap(NULL, sb.st_size, PROT_READ|PROT_WRITE,
-                             MAP_SHARED | MAP_POPULATE,
-                             unit_fd[unit], 0);
-            if (img[unit] == MAP_FAILED)
-                abend("mmap");
-            unit_segs[unit] = sb.st_size / 768;
+            img_open(unit, fname, oname, io);
+            sum_open(unit, oname ? oname : fname);
+            repl_open(unit, mirror);
+            snap_open(unit, snap, oname ? oname : fname);
+            journal_open(unit, oname ? oname : fname);  // Bases can be shared
             units++;
         }
         else
         {
-            unit_fd[unit] = -1;
             img[unit] = NULL;
             unit_segs[unit] = 0;
         }
     }
     if (!units)
         abend("No disk units");
+    img_prefault(prefault_tracks);
+    img_prefault_bg();
 } // file_init
 
+void file_sync()
+{
+    // Written sectors to disk, images stay mapped
+    trcache_sync();
+    for (int unit=0; unit<MAXUNITS; unit++)
+        if (img[unit])
+            img_sync(unit);
+}
+
 void file_close()
 {
     char *stopcmd;
     
+    trcache_reset();
     for (int unit=0; unit<MAXUNITS; unit++)
     {
         if (img[unit])
         {
-            munmap(img[unit], unit_segs[unit]*768);
-            close(unit_fd[unit]);
-            img[unit] = NULL;
-            unit_segs[unit] = 0;
-            unit_fd[unit] = -1;
+            journal_close(unit);
+            snap_close(unit);
+            sum_close(unit);
+            repl_close(unit);
+            img_close(unit);
         }
     }
     
@@ -472,57 +485,13 @@ uint32_t elapsed_us(struct timeval tv, struct timeval tbase)
 
 void set_connected(int conn)
 {
+    stats.connected = conn;
     if (conn)
         gpio_set(GP_CONN_BANK, GP_CONN_BIT);
     else
         gpio_clear(GP_CONN_BANK, GP_CONN_BIT);
 }
 
-void fetch_track()
-{
-    // Build track image from file data
-    uint32_t track = dsa >> 2;
-    uint32_t *imgptr;
-    int tridx = 0;
-    uint32_t parity;
-    
-    seek_error = ((track+1) << 2) > unit_segs[selected_unit];
-    if (!seek_error)
-    {
-        imgptr = img[selected_unit] + track*768; // (768 b / 4b/w) * 4 seg/tr
-        for (int sect=0; sect<4; sect++)
-        {
-            parity = ((((track<<2) & 0x7FC) + sect) << 8) | 0x80000000;
-            // We keep the word numbering of the DRC...
-            // Sector data occupies word 0..255. Reformat to 24-bit
-            //    24-bit:     32-bit (file):
-            //      cba0            dcba                           
-            //      fed0            hgfe
-            //      ihg0            lkji
-            //      lkj0
-            for (int i=0; i<256/4; i++)
-            {
-                parity ^= (trbuf[tridx++] = (imgptr[0] << 8) ^ INVMASK24);
-                parity ^= (trbuf[tridx++] = ((((imgptr[0] & 0xff000000) >> 16) | (imgptr[1] << 16))) ^INVMASK24);
-                parity ^= (trbuf[tridx++] = ((((imgptr[1] & 0xffff0000) >> 8)  | (imgptr[2] << 24))) ^INVMASK24);
-                parity ^= (trbuf[tridx++] = (imgptr[2] & 0xffffff00) ^INVMASK24);
-                imgptr += 3;
-            }
-            trbuf[tridx++] = parity;
-            for (int i=0; i<11; i++)
-            {
-                trbuf[tridx++] = ((((track << 2) & 0x7FC) + ((sect+1)&3))<< 8) | 0x80000000; // See DRC018
-            }
-        }
-        bzero(dirty, sizeof(dirty));
-    }
-    else
-    {
-        // seek error, make sync. error on DRC
-        bzero(trbuf, sizeof(trbuf));
-    }
-}
-
 void select_unit(int unit)
 {
     if (unit == selected_unit)
@@ -537,78 +506,132 @@ void select_unit(int unit)
     if (selected_unit >= 0)
         set_led(unit_to_led[selected_unit], 0);
     selected_unit = unit;
+    stats.unit_selects++;
     if (img[unit])
     {
-        fetch_track();
         set_led(unit_to_led[unit], 1);
-        FBS_LOG(G_SEEK, "Unit select: %d", unit);
+        FBS_TRACE(G_SEEK, EV_UNIT_SELECT, unit);
         set_connected(1);
         disconnected = 0;
     }
     else
     {
-        FBS_LOG(G_SEEK, "OFFLINE Unit select: %d", unit);
+        FBS_TRACE(G_SEEK, EV_UNIT_OFFLINE, unit);
         set_connected(0);
         disconnected = 1;
     }
 }
 
-void wait_powerok()
+void wait_powerok(int poll_us)
 {
     // The cpdsa signal from DRC is forced to 1 when power_ok is false (25V off)
     int cpdsa;
     int ledon = 0;
+    int waited = 500000;    // us since the LED changed
     
+    stats.power = 0;
+    stats_publish();
     while (1)
     {
-        set_led(ERR_LATCH_LED, (ledon = !ledon));
+        if ((waited += poll_us) >= 500000)
+        {
+            set_led(ERR_LATCH_LED, (ledon = !ledon));
+            waited = 0;
+        }
         cpdsa = 0;
         for (int j=0; j<24; j++)  // Could be just 2...
         {
             gpio_mirror[2] = gpio_mirror[2] | (1<<GP_RDCLK_BIT);
-            UPD_DRC;
+            CELL_HIGH(cell_next, gpio_mirror[2]);
             gpio_mirror[2] = gpio_mirror[2] & ~(1<<GP_RDCLK_BIT);
-            UPD_DRC;
-            UPD_DRC;  // For correct timing
+            CELL_LOW(cell_next, gpio_mirror[2]);
             cpdsa += (*gpio_datain_addr[GP_CPDSA_BANK] & (1<<GP_CPDSA_BIT)) != 0;
         }
         if (cpdsa < 2)
         {
             FBS_LOG(G_MISC, "DRC POWER ON(%d)", cpdsa);
             set_led(ERR_LATCH_LED, 0);
+            stats.power = 1;
+            stats.power_cycles++;
             return;
         }
         else
         {
-            sleep(1);
+            usleep(poll_us);
         }
     }
 }
 
-        
-void flush_track()
+#define CELL_TEST   (257*24)    // One sector
+static uint32_t cell_t[CELL_TEST];
+
+static double cell_test(double *jit_mean, double *jit_max)
 {
-    // Update dirty sectors in file data
-    uint32_t track = dsa >> 2;
-    uint32_t *imgptr;
-    int tridx;
+    // A sector of RDCLK cells without data, mean cell period in ns
+    uint32_t tc = fbs_ticks();
+    double mean, d;
 
-    for (int sect=0; sect<4; sect++)
+    for (int i=0; i<CELL_TEST; i++)
     {
-        if (dirty[sect])
+        gpio_mirror[2] = (gpio_mirror[2] & ~(1<<GP_RDDATA_BIT)) | (1<<GP_RDCLK_BIT);
+        CELL_HIGH(tc, gpio_mirror[2]);
+        cell_t[i] = fbs_ticks();
+        gpio_mirror[2] &= ~(1<<GP_RDCLK_BIT);
+        CELL_LOW(tc, gpio_mirror[2]);
+    }
+    mean = ticks_ns(cell_t[CELL_TEST-1] - cell_t[0]) / (CELL_TEST - 1.0);
+    *jit_mean = *jit_max = 0;
+    for (int i=1; i<CELL_TEST; i++)
+    {
+        d = ticks_ns(cell_t[i] - cell_t[i-1]) - mean;
+        if (d < 0)
+            d = -d;
+        *jit_mean += d;
+        if (d > *jit_max)
+            *jit_max = d;
+    }
+    *jit_mean /= CELL_TEST - 1;
+    return mean;
+}
+
+void bit_init()
+{
+    // FBS_BITNS: calibrate the cycle-counted bit cell.
+    // Then self-test the bit cell timing in use.
+    char *par;
+    uint32_t ns = 0;
+    double min_ns, mean, jit_mean, jit_max;
+
+    if ((par = getenv("FBS_BITNS")) != NULL)
+        ns = atoi(par);
+#if defined(__arm__)
+    if (ns && !tick_pmu)
+#elif !defined(__x86_64__) && !defined(__i386__)
+    if (ns)
+#else
+    if (0)
+#endif
+    {
+        FBS_LOG(G_ERROR, "FBS_BITNS needs the cycle counter, bit cells are store timed");
+        ns = 0;
+    }
+    if (ns)
+    {
+        // Fastest cell the bus and the counter allow
+        bit_ticks = 1;
+        bit_high = 0;
+        min_ns = cell_test(&jit_mean, &jit_max);
+        if (ns < min_ns)
         {
-            imgptr = img[selected_unit] + track*768 + sect*(768/4);
-            tridx = sect*268;
-            for (int i=0; i<256/4; i++)
-            {
-                *(imgptr++) = ((trbuf[tridx] >> 8) | ((trbuf[tridx+1] & 0x0000ff00) << 16)) ^INVMASK32;
-                *(imgptr++) = ((trbuf[tridx+1] >> 16) | ((trbuf[tridx+2] & 0x00ffff00) << 8)) ^INVMASK32;
-                *(imgptr++) = ((trbuf[tridx+2] >> 24) | (trbuf[tridx+3] & 0xffffff00)) ^INVMASK32;
-                tridx += 4;
-            }
-            dirty[sect] = 0;
+            FBS_LOG(G_ERROR, "FBS_BITNS=%u is below the %.0f ns the bus allows", ns, min_ns);
+            ns = min_ns + 1;
         }
+        bit_ticks = ns_ticks(ns);
+        bit_high = bit_ticks / 3;
     }
+    mean = cell_test(&jit_mean, &jit_max);
+    FBS_LOG(G_MISC, "Bit cell: %s%.1f ns, %.3f Mbit/s, jitter mean %.1f max %.1f ns",
+            bit_ticks ? "cycle counted, " : "store timed, ", mean, 1000 / mean, jit_mean, jit_max);
 }
 
 int send_rcv_words(uint32_t *ptr, int words, uint32_t *wbuf)
@@ -616,10 +639,10 @@ int send_rcv_words(uint32_t *ptr, int words, uint32_t *wbuf)
     // Common RD/WR loop. Writedata collected in wbuf, calculated parity appended.
     // wbuf must have room for (words+1) words 
     int32_t w;
-    int wr_ena;
-    uint32_t gpb1;
+    uint32_t gpb1 = 1<<GP_WE_BIT;  // No words, no WE
     uint32_t parity = 0;
     uint32_t wr_word = 0;
+    uint32_t tc = cell_next;
     
     for (int i=0; i<words; i++)
     {
@@ -635,12 +658,9 @@ int send_rcv_words(uint32_t *ptr, int words, uint32_t *wbuf)
             gpio_mirror[2] = (gpio_mirror[2] & ~(1<<GP_RDDATA_BIT)) |
                              (1<<GP_RDCLK_BIT) |
                              (rd_dlybit << GP_RDDATA_BIT);
-            UPD_DRC;
+            CELL_HIGH(tc, gpio_mirror[2]);
             gpio_mirror[2] &= ~(1<<GP_RDCLK_BIT);
-            UPD_DRC;
-#ifndef OVERCLOCK
-            UPD_DRC;  // For correct timing
-#endif
+            CELL_LOW(tc, gpio_mirror[2]);
             rd_dlybit = (w>=0);
             w += w;
         }
@@ -652,14 +672,51 @@ int send_rcv_words(uint32_t *ptr, int words, uint32_t *wbuf)
             *(wbuf++) = (wr_word << 8); 
     }
     *wbuf = parity; // append calculated parity (w.o. segm addr word)
+    cell_next = tc;
+    return (gpb1 & (1<<GP_WE_BIT)) == 0;  // WE in same bank as WR_DATA, WE is inverted at 68A1
+}
+
+int send_rcv_wave(uint32_t *ptr, uint32_t *wv, int words, uint32_t *wbuf)
+{
+    // As send_rcv_words, but streams the precompiled waveform wv of the words at ptr
+    uint32_t gpb1 = 1<<GP_WE_BIT;  // No words, no WE
+    uint32_t parity = 0;
+    uint32_t wr_word = 0;
+    uint32_t base = gpio_mirror[2] & ~WAVE_MASK;
+    uint32_t tc = cell_next;
+    
+    for (int i=0; i<words; i++)
+    {
+        for (int j=0; j<24; j++)
+        {
+            // Get writedata, in case it's write...
+            gpb1 = *gpio_datain_addr[GP_WRDATA_BANK];
+            wr_word = (wr_word<<1) | ((gpb1 & (1<<GP_WRDATA_BIT)) != 0);
+            
+            CELL_HIGH(tc, base | wv[0]);
+            CELL_LOW(tc, base | wv[1]);
+            wv += WAVE_CELL;
+        }
+        if (i < words-1)
+            // Store wrdata, calc parity
+            parity ^= (*(wbuf++) = (wr_word << 8));
+        else
+            // Save received parity or address word
+            *(wbuf++) = (wr_word << 8); 
+    }
+    *wbuf = parity; // append calculated parity (w.o. segm addr word)
+    gpio_mirror[2] = base | wv[-1];
+    rd_dlybit = !((ptr[words-1] >> 8) & 1);  // Last bit sent
+    cell_next = tc;
     return (gpb1 & (1<<GP_WE_BIT)) == 0;  // WE in same bank as WR_DATA, WE is inverted at 68A1
 }
 
-int do_word_257_267(uint32_t *ptr, int index_sector, uint32_t *w267)
+int do_word_257_267(uint32_t *ptr, int index_sector, uint32_t *w267, int *accessed)
 {
     // Send address words from ptr
     // Handle track change; return 1 if WE, return -1 if +25V off
     // Collect address word (w267) from DRC, for write check
+    // accessed: sector was read or written
     int32_t w;
     int cpdsa = 0;
     int chtrack = 0;
@@ -668,10 +725,31 @@ int do_word_257_267(uint32_t *ptr, int index_sector, uint32_t *w267)
     uint32_t newdsa;
     uint32_t nonsense[11];
     int wr_ena;
-    int accessed = 0;
+    int dsa_written;
+    int ofs = ptr - trbuf;
+    uint32_t *wv = track_wave(ptr);
+    uint32_t base;
+    uint32_t t_win = 0, t0 = 0;
+    uint32_t tc = cell_next;
     
+    *accessed = 0;
+
     // Handle Word257:
     w = (int32_t)(*(ptr++));
+    if (wv)
+    {   // Precompiled, INDEX included
+        base = gpio_mirror[2] & ~WAVE_MASK;
+        for (int j=0; j<24; j++)
+        {
+            CELL_HIGH(tc, base | wv[0]);
+            CELL_LOW(tc, base | wv[1]);
+            cpdsa += (*gpio_datain_addr[GP_CPDSA_BANK] & (1<<GP_CPDSA_BIT)) != 0;
+            wv += WAVE_CELL;
+        }
+        gpio_mirror[2] = base | wv[-1];
+        rd_dlybit = !((ptr[-1] >> 8) & 1);
+    }
+    else
     for (int j=0; j<24; j++)
     {
         // Data is sampled 200 ns after pos edge on clk-GPIO. 
@@ -683,50 +761,58 @@ int do_word_257_267(uint32_t *ptr, int index_sector, uint32_t *w267)
             gpio_mirror[2] &= ~(1<<GP_INDEX_BIT);
         else
             gpio_mirror[2] |= 1<<GP_INDEX_BIT;
-        UPD_DRC;
+        CELL_HIGH(tc, gpio_mirror[2]);
         gpio_mirror[2] &= ~(1<<GP_RDCLK_BIT);
-        UPD_DRC;
-#ifndef OVERCLOCK
-        UPD_DRC;  // For correct timing
-#endif
+        CELL_LOW(tc, gpio_mirror[2]);
         cpdsa += (*gpio_datain_addr[GP_CPDSA_BANK] & (1<<GP_CPDSA_BIT)) != 0;
         rd_dlybit = (w>=0);
         w += w;
     }
     
     // Handle segment# update
+    cell_next = tc;
+    HIST_START(t_win);
     if (cpdsa > 1)
     {
-        FBS_LOG(G_MISC, "DRC POWER FAULT(%d)", cpdsa);
+        FBS_TRACE(G_MISC, EV_POWER_FAULT, cpdsa);
         return -1;
     }
     
-    if (poll_dsa(&newdsa))
+    HIST_START(t0);
+    dsa_written = poll_dsa(&newdsa);
+    HIST_END(H_POLLDSA, t0);
+    if (dsa_written && recording)
+        record_dsa(newdsa);
+    if (dsa_written)
     {   // DSA was written by RC4000
         newunit = (newdsa >> 17) & 3;
         chunit = (newunit != selected_unit);
         newdsa &= 0x1ffff;
         chtrack = chunit || ((newdsa & 0x1fffc) != (dsa & 0x1fffc));
-        FBS_LOG(G_SEEK, "Tr: %d New Unit, DSA: %d %d", trackcnt, newunit, newdsa);
+        FBS_TRACE(G_SEEK, EV_NEW_DSA, trackcnt, newunit, newdsa);
     }
     else
     if (cpdsa==1)
     {   // Sector was read or written
         newdsa = ((dsa+1) & 0x1FFFF);
         chtrack = (newdsa & 3) == 0;
-        FBS_LOG(G_SEEK, "Tr: %d Incr DSA: %d", trackcnt, newdsa);
-        accessed = 1;
+        FBS_TRACE(G_SEEK, EV_INCR_DSA, trackcnt, newdsa);
+        *accessed = 1;
     }
     else
         newdsa = dsa;
     
     if (chtrack)
     {
-        flush_track();
+        stats.seeks++;
         if (chunit)
             select_unit(newunit);
         dsa = newdsa;
-        fetch_track();  // Changes the data ptr points at!!
+        HIST_START(t0);
+        fetch_track();  // Changes the track ptr points into!!
+        HIST_END(H_FETCH, t0);
+        stats.seek_errors += seek_error;
+        ptr = trbuf + ofs + 1;
     }
     else
         dsa = newdsa;
@@ -734,7 +820,11 @@ int do_word_257_267(uint32_t *ptr, int index_sector, uint32_t *w267)
     // end segment# update
         
     // Send 258-267
-    wr_ena = send_rcv_words(ptr, 10, nonsense);
+    HIST_END(H_WINDOW, t_win);
+    if ((wv = track_wave(ptr)) != NULL)
+        wr_ena = send_rcv_wave(ptr, wv, 10, nonsense);
+    else
+        wr_ena = send_rcv_words(ptr, 10, nonsense);
     *w267 = nonsense[9];
 #ifdef STANDALONE_TEST
     return 0;
@@ -743,73 +833,131 @@ int do_word_257_267(uint32_t *ptr, int index_sector, uint32_t *w267)
     if (wr_ena)
         blink(WR_LED,1);
      else
-     if (accessed)
+     if (*accessed)
         blink(RD_LED,1);
             
     return wr_ena;
 }
 
+int write_sector(int sect, uint32_t *wr_buf, uint32_t segm_addr_w)
+{
+    // Parity check of the words received for sect, update trbuf if OK.
+    // wr_buf[257] is the parity calculated by send_rcv_words.
+    if (wr_buf[256] != (wr_buf[257] ^ segm_addr_w))
+        return 0;
+    memcpy(trbuf+(sect*268), wr_buf, 257*4);
+    dirty[sect] = 1;
+    wave_ok[sect] = 0;
+    return 1;
+}
+
+static void track_high(uint32_t *hi, uint32_t x)
+{
+    // Follow the high end of x: up fast, down slowly
+    if (x > *hi)
+        *hi += (x - *hi) / 8 + 1;
+    else
+        *hi -= (*hi - x) / 256;
+}
+
 void main_loop()
 {
     uint32_t *trp;
+    uint32_t *wvp;
     uint32_t wr_buf[258];
     int wr_ena = 0;
     uint32_t w267_DRC;
     int wr_fault = 0;
-    uint32_t calc_parity;
+    int accessed;
+    int rd;
     uint32_t segm_addr_w = 0x80000000;
     struct timeval starttime, laptime, now;
     struct timeval lap2;
     uint32_t tr_time, tmin=1000000, tmax=0;
-
+    uint32_t t_rot = 0, t_slack;
+    uint32_t t_sect0, t_tail = 0;
+    uint32_t work_hi = 0;   // Sector transfers of a rotation, high end
+    uint32_t tail_hi = 0;   // Sched end to sector 0, high end
+    uint32_t work, slack;
+    int busy = 0;
+
+    HIST_START(t_rot);
     gettimeofday(&starttime, NULL);
     laptime = starttime;
     lap2 = laptime;
     while (1)
     {
-        trp = trbuf; 
+        t_sect0 = fbs_ticks();
+        if (t_tail)
+            track_high(&tail_hi, t_sect0 - t_tail);
         for (int sect=0; sect<4; sect++)
         {
-            send_rcv_words(trp, 257, wr_buf); // data + parity
+            track_sector(sect);
+            trp = trbuf + sect*268;
+            if ((wvp = track_wave(trp)) != NULL)
+                send_rcv_wave(trp, wvp, 257, wr_buf);
+            else
+                send_rcv_words(trp, 257, wr_buf); // data + parity
             set_connected(!disconnected);  // Clear temp. error status
             if (wr_ena && !seek_error)
             {   // Writes during seek error are ignored with silence
-                calc_parity = wr_buf[257] ^ segm_addr_w; 
-                wr_fault |= wr_buf[256] != calc_parity;
-                if (wr_fault)
+                if (wr_fault || !write_sector(sect, wr_buf, segm_addr_w))
                 {
                     set_connected(0);  // Only means we have to signal write error
-                    FBS_LOG(G_ERROR, "Tr: %d WRITE ERROR Segm: %d Addr: %08x Exp: %08x Parity: %08x Exp: %08x  W257: %08x",
-                                     trackcnt, dsa, w267_DRC, segm_addr_w, wr_buf[256], calc_parity, wr_buf[257]);
+                    stats.wr_faults++;
+                    FBS_TRACE(G_ERROR, EV_WRITE_ERROR,
+                              trackcnt, dsa, w267_DRC, segm_addr_w, wr_buf[256],
+                              wr_buf[257] ^ segm_addr_w, wr_buf[257]);
                     blink(ERR_LED,5);
                     set_led(ERR_LATCH_LED, 1);
                 }
                 else
-                {   // Write OK: Update sector in trbuf
-                    memcpy(trbuf+(sect*268), wr_buf, 257*4);
-                    dirty[sect] = 1;
-                    FBS_LOG(G_DATA, "Tr: %d Write data: Sector: %d Data[0..1]: %06X %06X",
+                {   // Write OK: sector updated in trbuf
+                    stats.writes[selected_unit]++;
+                    FBS_TRACE(G_DATA, EV_WRITE_DATA,
                                     trackcnt,
                                     (dsa & 0x1fffc)+sect,
                                     wr_buf[0] >> 8,
                                     wr_buf[1] >> 8);
                 }
             }
-            trp += 257;
-            wr_ena = do_word_257_267(trp, sect==3, &w267_DRC);
+            rd = !wr_ena;
+            wr_ena = do_word_257_267(trp+257, sect==3, &w267_DRC, &accessed);
+            if (recording)
+                record_sector(rd ? NULL : wr_buf, accessed, wr_ena > 0, w267_DRC, wr_ena < 0);
             if (wr_ena < 0)
             {
-                if (!seek_error) // paranoia
-                    flush_track();
+                trcache_sync();
+                record_stop();
+                sched_report();
+                trace_flush();
+                if (hist_on)
+                    hist_dump();
+                stats_publish();
                 return; // Power fault
             }
+            if (accessed && rd)
+                stats.reads[selected_unit]++;
+            busy |= accessed || wr_ena;
             
             segm_addr_w = ((((dsa & 0x7FC) + ((sect+1)&3)) << 8) | 0x80000000); // Address is for *next* sector on track
             wr_fault = wr_ena && (w267_DRC != segm_addr_w);
-            trp += 11;
         }
+        t_slack = fbs_ticks();
         trackcnt++;
+        if (recording)
+            record_start(selected_unit, dsa, wr_ena, w267_DRC);
         upd_leds();
+        // Slack: how much shorter than the long ones, that the DRC sees
+        // all the time, the sector transfers of this rotation were
+        work = t_slack - t_sect0;
+        track_high(&work_hi, work);
+        slack = work_hi > work + tail_hi ? work_hi - work - tail_hi : 0;
+        sched_run(t_slack, slack, !busy);
+        t_tail = fbs_ticks();
+        busy = 0;
+        HIST_END(H_ROTATION, t_rot);
+        HIST_START(t_rot);
         
         // Monitor min/max rotation time
         gettimeofday(&now, NULL);
@@ -819,30 +967,44 @@ void main_loop()
             tmax = tr_time; 
         if (tr_time < tmin)
             tmin = tr_time;
+        stats.rotations++;
+        stats.rot_last = tr_time;
+        stats.rot_sum += tr_time;
+        if (tr_time > stats.rot_max)
+            stats.rot_max = tr_time;
+        if (tr_time < stats.rot_min)
+            stats.rot_min = tr_time;
+        stats_publish();
         
-        if (!(trackcnt & 127))
+        if (!(trackcnt & 2047))
         {
-            flush_track(); // Don't let written data get stuck in trackbuf
-            if (!(trackcnt & 2047))
-            {
-                gettimeofday(&now, NULL);
-                FBS_LOG(G_STAT, "Min/max/avg rotation time: %d/%d/%d us",
-                         tmin, tmax, elapsed_us(now, laptime)/2048);
-                tmin = 1000000;
-                tmax = 0;
-                laptime = now;
-            }
+            gettimeofday(&now, NULL);
+            FBS_TRACE(G_STAT, EV_ROTATION,
+                      tmin, tmax, elapsed_us(now, laptime)/2048);
+            FBS_TRACE(G_STAT, EV_TRCACHE,
+                      trstat.hits, trstat.misses, trstat.evictions, trstat.dirty_evictions,
+                      trstat.prefetches, trstat.pf_hits, trstat.pf_misses);
+            FBS_TRACE(G_STAT, EV_WRITER,
+                      wrstat.queued, wrstat.full, wrstat.maxdepth, wrstat.waits);
+            tmin = 1000000;
+            tmax = 0;
+            laptime = now;
         }
     }
 }
 
         
+#ifndef FBS_BENCH
 int main (int argc, char *argv[])
 {
 	int i = 0, j = 0;
     int tw;
     int rw;
     int dummy;
+    int keep;
+    int warm = 0;   // Images, track cache and stats kept from the last power cycle
+    char *par;
+    struct timeval t_on, now;
  
     fbs_openlog();
 	gpio_init();
@@ -853,9 +1015,37 @@ int main (int argc, char *argv[])
         set_led(j,1);
     }
 
-	// Abend immediately if file problems
+	kernels_init();
+	trcache_init();
+	journal_init();
+	sum_init();
+	writer_init();
+	trace_init();
+	record_init();
+	stats_init();
+	rt_init();      // After the writer thread, only the drum loop runs SCHED_FIFO
+	bit_init();
+	sched_init();
+	snap_init();
+	rt_lock();      // Before the images are mapped
+
+	if ((par = getenv("FBS_LEDTEST_MS")) != NULL)
+	    ledtest_ms = atoi(par);
+	if ((par = getenv("FBS_POWERPOLL_MS")) != NULL)
+	    powerpoll_ms = atoi(par);
+	if ((par = getenv("FBS_STANDBY_US")) != NULL)
+	    standby_us = atoi(par);
+	if ((par = getenv("FBS_PREFAULT")) != NULL)
+	    prefault_tracks = atoi(par);
+
+	// Abend immediately if file problems.
+	// Images stay mapped over power cycles (warm standby), unless FBS_STOP
+	// has to run with the images closed or FBS_STANDBY=0
+	keep = getenv("FBS_STOP") == NULL &&
+	       ((par = getenv("FBS_STANDBY")) == NULL || atoi(par));
 	file_init();
-	file_close();
+	if (!keep)
+	    file_close();
 
 	FBS_LOG(G_MISC, "Started");
 	
@@ -867,16 +1057,18 @@ int main (int argc, char *argv[])
             set_led(j,0);
         }
     
-	    wait_powerok();
-	    file_init();
+	    wait_powerok(warm ? standby_us : powerpoll_ms*1000);
+	    gettimeofday(&t_on, NULL);
+	    if (!keep)
+	        file_init();
 
-        // Short LED test at startup
-        for (j=0; j<8; j++)
+        // Short LED test at startup, not when warm
+        for (j=0; j<8 && ledtest_ms && !warm; j++)
         {
             set_led(j,1);
-            usleep(100000);
+            usleep(ledtest_ms*1000);
             set_led(j,0);
-            usleep(100000);
+            usleep(ledtest_ms*1000);
         }
         selected_unit = -1;
         for (int unit=0; unit<MAXUNITS; unit++)
@@ -890,7 +1082,35 @@ int main (int argc, char *argv[])
         dsa = 0;
         
         fetch_track();
+        gettimeofday(&now, NULL);
+        stats.connect_us = elapsed_us(now, t_on);
+        if (warm)
+        {
+            stats.warm_connects++;
+            stats.connect_warm_us = stats.connect_us;
+            if (stats.connect_us > stats.connect_warm_max_us)
+                stats.connect_warm_max_us = stats.connect_us;
+        }
+        else
+            stats.connect_cold_us = stats.connect_us;
+        FBS_LOG(G_MISC, "Connected %u.%03u ms after power on (%s)",
+                stats.connect_us / 1000, stats.connect_us % 1000, warm ? "warm" : "cold");
         main_loop();
-        file_close();
+#ifdef FBS_SIM
+        if (!sim_power_back())
+        {
+            file_sync();
+            repl_sync();
+            i = sim_report() != 0;  // Last power cycle, hashes and verifies the images
+            file_close();
+            return i;
+        }
+#endif
+        if (keep)
+            file_sync();
+        else
+            file_close();
+        warm = keep;
     }
-}
\ No newline at end of file
+}
+#endif
\ No newline at end of file
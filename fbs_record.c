@@ -0,0 +1,176 @@
+// FBS4000 - Future Backing Storage for RC4000 w. DRC401 and a BeagleBone (tm)
+// Recorder of what the RC4000 does on the DRC bus, per sector
+//
+// With FBS_RECORD=<file> the drum loop logs, for every sector of the
+// first power cycle: the DSA written by the RC4000 (poll_dsa), whether
+// CPDSA was pulsed, WE for the next sector with the address echo in word
+// 267, and the words written. Records go through a SPSC ring to a thread
+// that writes the file. The simulator replays it with FBS_REPLAY.
+//
+// Recording starts after the first rotation, when the DRC has seen INDEX.
+// The header holds the unit, DSA and WE at that point.
+//
+// File: struct rec_hdr, then per sector a flags byte (REC_*), the DSA if
+// REC_DSA, word 267 if REC_WE, and 257 words (data, parity) if REC_DATA.
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <sys/resource.h>
+#include <sys/syscall.h>
+#include "fbs.h"
+#include "fbs_ring.h"
+
+struct bus_rec
+{
+    uint32_t flags;
+    uint32_t sr;
+    uint32_t w267;
+    uint32_t words[257];
+};
+
+int recording = 0;
+static struct spsc_ring ring;
+static FILE *recfile;
+static pthread_t record_tid;
+static int started;
+static uint32_t pend_sr;
+static int pend_dsa;
+static uint32_t sectors;
+static _Atomic uint32_t overruns;   // Logged by record_writer()
+
+static void *record_writer(void *arg)
+{
+    struct bus_rec *r;
+    uint8_t flags;
+    uint32_t reported = 0;
+
+    setpriority(PRIO_PROCESS, syscall(SYS_gettid), 10);
+    while (1)
+    {
+        if (atomic_load(&overruns) != reported)
+        {
+            reported = atomic_load(&overruns);
+            FBS_LOG(G_ERROR, "Recorder overrun, recording stopped after %u sectors", sectors);
+        }
+        if ((r = ring_get(&ring)) == NULL)
+        {
+            usleep(1000);
+            continue;
+        }
+        if (r->flags & REC_HDR)
+        {
+            struct rec_hdr h = {REC_MAGIC, REC_VERSION, r->sr, r->flags & REC_WE, r->w267};
+
+            for (int unit=0; unit<MAXUNITS; unit++)
+                h.segs[unit] = unit_segs[unit];
+            fwrite(&h, sizeof(h), 1, recfile);
+        }
+        else
+        {
+            flags = r->flags;
+            fwrite(&flags, 1, 1, recfile);
+            if (flags & REC_DSA)
+                fwrite(&r->sr, 4, 1, recfile);
+            if (flags & REC_WE)
+                fwrite(&r->w267, 4, 1, recfile);
+            if (flags & REC_DATA)
+                fwrite(r->words, 4, 257, recfile);
+        }
+        if (ring_used(&ring) == 1)
+            fflush(recfile);    // Before record_stop() can see the ring empty
+        ring_get_done(&ring);
+    }
+    return NULL;
+}
+
+void record_init()
+{
+    char *par;
+
+    if ((par = getenv("FBS_RECORD")) == NULL)
+        return;
+    if ((recfile = fopen(par, "w")) == NULL)
+        abend("Cannot open FBS_RECORD");
+    if (!ring_init(&ring, 256, sizeof(struct bus_rec)))
+        abend("record_init");
+    if (pthread_create(&record_tid, NULL, record_writer, NULL))
+        abend("pthread_create, record");
+    recording = 1;
+    FBS_LOG(G_MISC, "Recording DRC bus to %s", par);
+}
+
+static struct bus_rec *rec_put()
+{
+    // A gap makes the recording useless, give up. Logged by the recorder thread.
+    struct bus_rec *r = ring_put(&ring);
+
+    if (!r)
+    {
+        recording = 0;
+        atomic_fetch_add(&overruns, 1);
+    }
+    return r;
+}
+
+void record_start(int unit, uint32_t dsa, int we, uint32_t w267)
+{
+    // Header: state after the first rotation
+    struct bus_rec *r;
+
+    if (started || !(r = rec_put()))
+        return;
+    r->flags = REC_HDR | (we ? REC_WE : 0);
+    r->sr = (unit << 17) | dsa;
+    r->w267 = w267;
+    ring_put_done(&ring);
+    started = 1;
+}
+
+void record_dsa(uint32_t sr)
+{
+    // DSA shifted in by poll_dsa, goes with the current sector
+    pend_sr = sr;
+    pend_dsa = 1;
+}
+
+void record_sector(uint32_t *wbuf, int accessed, int we, uint32_t w267, int power_fault)
+{
+    // wbuf: words written to this sector, or NULL
+    struct bus_rec *r;
+
+    if (!started)
+    {
+        pend_dsa = 0;
+        return;
+    }
+    if (!(r = rec_put()))
+        return;
+    r->flags = (pend_dsa ? REC_DSA : 0) | (accessed ? REC_CPDSA : 0) |
+               (we ? REC_WE : 0) | (wbuf ? REC_DATA : 0) |
+               (power_fault ? REC_POWER : 0);
+    r->sr = pend_sr;
+    r->w267 = w267;
+    if (wbuf)
+        memcpy(r->words, wbuf, 257*4);
+    ring_put_done(&ring);
+    pend_dsa = 0;
+    sectors++;
+}
+
+void record_stop()
+{
+    // Power fault: write out the recording, not in the drum loop
+    if (!recfile)
+        return;
+    while (ring_used(&ring))
+        usleep(1000);
+    fclose(recfile);
+    recfile = NULL;
+    recording = 0;
+    FBS_LOG(G_MISC, "Recorded %u sectors", sectors);
+}
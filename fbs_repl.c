@@ -0,0 +1,362 @@
+// FBS4000 - Future Backing Storage for RC4000 w. DRC401 and a BeagleBone (tm)
+// Asynchronous replication of written sectors to a mirror
+//
+// With UNITn_MIRROR=<file> every sector the writer stores in unit n is
+// also written to a packed mirror image, with UNITn_MIRROR=unix:<path> it
+// is sent to a receiver on a UNIX socket (fbsimg receive). The writer
+// thread queues (unit, segment, packed data) in a ring of FBS_REPL_RING
+// records; a replication thread takes up to FBS_REPL_BATCH at a time,
+// numbers them and writes the batch: pwrite and one fdatasync to a file,
+// one struct repl_batch and its records to a socket.
+//
+// Nothing waits for the mirror. When the ring is full the sector is
+// dropped, counted as lag, and its track marked for resync. With the
+// ring empty the thread resyncs marked tracks from the image, a whole
+// track at a time; a file mirror track that is already equal is not
+// written. The mark is cleared before the track is read, and a sector
+// is queued after it is stored, so the mirror always ends up with the
+// last data. All tracks are marked at startup and when a socket
+// connection is lost. When the image is closed the queued sectors are
+// sent before it is unmapped. The marks are kept: opened again with the
+// same mirror, the image resyncs what was left, not every track, and a
+// power cycle with the images closed does not wait for a resync.
+// repl_sync() completes it, before a last close.
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <sys/resource.h>
+#include <sys/socket.h>
+#include <sys/syscall.h>
+#include <sys/time.h>
+#include <sys/un.h>
+#include "fbs.h"
+#include "fbs_ring.h"
+
+struct mirror
+{
+    char *target;           // NULL: image closed
+    char *last;             // Mirror of the marks in resync
+    uint32_t tracks;
+    int fd;                 // -1: socket not connected
+    int sock;
+    uint32_t seq;           // Next record
+    _Atomic uint8_t *resync;    // Per track
+    _Atomic uint32_t marked;
+    uint32_t next;          // Resync cursor
+};
+
+int repl_on = 0;
+static struct mirror mirrors[MAXUNITS];
+static struct spsc_ring ring;
+static uint32_t batch_max = 32;
+static pthread_t repl_tid;
+static pthread_mutex_t repl_lock = PTHREAD_MUTEX_INITIALIZER;  // Mirrors, against repl_close()
+struct repl_stats replstat;
+
+static void read_sector(int unit, uint32_t seg, uint32_t *data)
+{
+    // Packed data of a segment in the image
+    const uint32_t *p = img_drum_track(unit, seg >> 2);
+
+    if (p)
+        decode_sector(data, p + (seg&3)*SECT_WORDS);
+    else
+        memcpy(data, img_track(unit, seg >> 2) + (seg&3)*(768/4), 768);
+}
+
+static void mark_all(int unit)
+{
+    struct mirror *m = &mirrors[unit];
+
+    for (uint32_t t=0; t<unit_segs[unit]/4; t++)
+        if (!atomic_exchange(&m->resync[t], 1))
+            atomic_fetch_add(&m->marked, 1);
+}
+
+static int connect_mirror(struct mirror *m)
+{
+    // Socket mirror: (re)connect, 0 if the receiver is not there
+    struct sockaddr_un sa = {.sun_family = AF_UNIX};
+    struct timeval tv = {1, 0};     // A receiver that stops reading is lost
+
+    if (m->fd >= 0)
+        return 1;
+    if ((m->fd = socket(AF_UNIX, SOCK_STREAM, 0)) < 0)
+        abend("socket, mirror");
+    strncpy(sa.sun_path, m->target + 5, sizeof(sa.sun_path)-1);
+    if (connect(m->fd, (struct sockaddr *)&sa, sizeof(sa)) == 0 &&
+        setsockopt(m->fd, SOL_SOCKET, SO_SNDTIMEO, &tv, sizeof(tv)) == 0)
+    {
+        m->seq = 0;     // Numbered per connection
+        FBS_LOG(G_MISC, "Mirror %s connected", m->target);
+        return 1;
+    }
+    close(m->fd);
+    m->fd = -1;
+    return 0;
+}
+
+static int send_all(int fd, const void *buf, size_t len)
+{
+    ssize_t n;
+
+    for (const char *p = buf; len; p+=n, len-=n)
+        if ((n = send(fd, p, len, MSG_NOSIGNAL)) <= 0)
+            return 0;
+    return 1;
+}
+
+static void send_batch(int unit, struct repl_rec *recs, uint32_t n)
+{
+    // Records of one unit to its mirror
+    struct mirror *m = &mirrors[unit];
+    struct repl_batch b = {REPL_MAGIC, m->seq, n};
+
+    m->seq += n;
+    if (!m->sock)
+    {
+        for (uint32_t i=0; i<n; i++)
+            if (pwrite(m->fd, recs[i].data, 768, (off_t)recs[i].seg*768) != 768)
+                abend("pwrite, mirror");
+        if (fdatasync(m->fd))
+            abend("fdatasync, mirror");
+        atomic_fetch_add(&replstat.sent, n);
+        atomic_fetch_add(&replstat.batches, 1);
+        return;
+    }
+    if (!connect_mirror(m))
+    {
+        atomic_fetch_add(&replstat.lag, n);
+        return;     // Marked when it was lost
+    }
+    if (send_all(m->fd, &b, sizeof(b)) && send_all(m->fd, recs, n*sizeof(*recs)))
+    {
+        atomic_fetch_add(&replstat.sent, n);
+        atomic_fetch_add(&replstat.batches, 1);
+        return;
+    }
+    FBS_LOG(G_ERROR, "Mirror %s lost, resync when it is back", m->target);
+    close(m->fd);
+    m->fd = -1;
+    atomic_fetch_add(&replstat.lag, n);
+    mark_all(unit);
+}
+
+static int resync_track(int unit)
+{
+    // Next marked track of the unit to the mirror, 0 if none
+    struct mirror *m = &mirrors[unit];
+    uint32_t tracks = unit_segs[unit] / 4;
+    struct repl_rec recs[4];
+    uint32_t old[768];
+    uint32_t t;
+
+    if (!atomic_load(&m->marked) || (m->sock && !connect_mirror(m)))
+        return 0;
+    for (uint32_t i=0; i<tracks; i++, m->next = (m->next+1) % tracks)
+        if (atomic_load(&m->resync[m->next]))
+            break;
+    t = m->next;
+    if (!atomic_exchange(&m->resync[t], 0))
+        return 0;
+    atomic_fetch_sub(&m->marked, 1);
+    for (int sect=0; sect<4; sect++)
+    {
+        recs[sect].unit = unit;
+        recs[sect].seg = t*4 + sect;
+        read_sector(unit, t*4 + sect, recs[sect].data);
+    }
+    atomic_fetch_add(&replstat.resynced, 1);
+    if (!m->sock && pread(m->fd, old, sizeof(old), (off_t)t*768*4) == sizeof(old))
+    {
+        int same = 1;
+
+        for (int sect=0; sect<4 && same; sect++)
+            same = !memcmp(old + sect*192, recs[sect].data, 768);
+        if (same)
+            return 1;
+    }
+    send_batch(unit, recs, 4);
+    return 1;
+}
+
+static int send_queued(struct repl_rec *recs)
+{
+    // A batch of one unit from the ring, in queue order, 0 if empty.
+    // repl_lock held, records of a closed mirror are dropped.
+    struct repl_rec *r;
+    uint32_t n;
+
+    for (n = 0; n < batch_max && (r = ring_get(&ring)) != NULL; n++)
+    {
+        if (n && r->unit != recs[0].unit)
+            break;
+        recs[n] = *r;
+        ring_get_done(&ring);
+    }
+    if (n && mirrors[recs[0].unit].target)
+        send_batch(recs[0].unit, recs, n);
+    return n;
+}
+
+static void *replicator(void *arg)
+{
+    struct repl_rec recs[batch_max];
+    int unit, busy;
+
+    rt_background();
+    setpriority(PRIO_PROCESS, syscall(SYS_gettid), 10);
+    while (1)
+    {
+        pthread_mutex_lock(&repl_lock);
+        if (send_queued(recs))
+        {
+            pthread_mutex_unlock(&repl_lock);
+            continue;
+        }
+        busy = 0;
+        for (unit=0; unit<MAXUNITS; unit++)
+            if (mirrors[unit].target)
+                for (int i=0; i<16 && !ring_used(&ring) && resync_track(unit); i++)
+                    busy = 1;
+        pthread_mutex_unlock(&repl_lock);
+        if (!busy)
+            usleep(1000);
+    }
+    return NULL;
+}
+
+void repl_open(int unit, char *target)
+{
+    // Mirror for an image just opened, NULL: none
+    struct mirror *m = &mirrors[unit];
+    char *par;
+
+    if (!target)
+        return;
+    if (!repl_on)
+    {
+        uint32_t depth = 256;
+
+        if ((par = getenv("FBS_REPL_RING")) != NULL)
+            depth = strtoul(par, NULL, 0);
+        if ((par = getenv("FBS_REPL_BATCH")) != NULL)
+            batch_max = strtoul(par, NULL, 0);
+        if (depth < 4 || batch_max < 1)
+            abend("Error in FBS_REPL_RING/FBS_REPL_BATCH");
+        if (!ring_init(&ring, depth, sizeof(struct repl_rec)))
+            abend("repl_open");
+        repl_on = 1;
+        if (pthread_create(&repl_tid, NULL, replicator, NULL))
+            abend("pthread_create, replicator");
+    }
+    pthread_mutex_lock(&repl_lock);
+    m->sock = !strncmp(target, "unix:", 5);
+    m->fd = -1;
+    if (!m->sock)
+    {
+        if ((m->fd = open(target, O_RDWR | O_CREAT, 0644)) < 0)
+            abend("Cannot open mirror");
+        if (ftruncate(m->fd, (off_t)unit_segs[unit]*768))
+            abend("ftruncate, mirror");
+    }
+    if (!m->resync || strcmp(m->last, target) || m->tracks != unit_segs[unit]/4)
+    {
+        free((void *)m->resync);
+        free(m->last);
+        m->tracks = unit_segs[unit]/4;
+        m->marked = 0;
+        m->next = 0;
+        if (!(m->resync = calloc(m->tracks, 1)) || !(m->last = strdup(target)))
+            abend("repl_open");
+        mark_all(unit);
+    }
+    m->target = target;
+    pthread_mutex_unlock(&repl_lock);
+    FBS_LOG(G_MISC, "Unit %d: mirror %s, ring %u sectors, batch %u, %u tracks to resync",
+            unit, target, ring.size, batch_max, atomic_load(&m->marked));
+}
+
+void repl_store(int unit, uint32_t seg)
+{
+    // Writer thread: segment stored in the image, queue it or mark its track
+    struct mirror *m = &mirrors[unit];
+    struct repl_rec *r;
+
+    if (!m->target)
+        return;
+    if ((r = ring_put(&ring)) == NULL)
+    {
+        atomic_fetch_add(&replstat.lag, 1);
+        if (!atomic_exchange(&m->resync[seg >> 2], 1))
+            atomic_fetch_add(&m->marked, 1);
+        return;
+    }
+    r->unit = unit;
+    r->seg = seg;
+    read_sector(unit, seg, r->data);
+    ring_put_done(&ring);
+    atomic_fetch_add(&replstat.queued, 1);
+}
+
+void repl_close(int unit)
+{
+    // Writer drained, the image is about to be unmapped
+    struct mirror *m = &mirrors[unit];
+    struct repl_rec recs[batch_max];
+
+    if (!m->target)
+        return;
+    pthread_mutex_lock(&repl_lock);
+    while (send_queued(recs))
+        ;   // The replicator waits meanwhile
+    if (m->marked)
+        FBS_LOG(G_MISC, "Unit %d: mirror %s is %u tracks behind, resync when opened",
+                unit, m->target, m->marked);
+    if (m->fd >= 0)
+        close(m->fd);
+    m->fd = -1;
+    m->target = NULL;       // Marks kept for the next open
+    pthread_mutex_unlock(&repl_lock);
+}
+
+void repl_sync()
+{
+    // Writer drained: the queue and the marked tracks of all open mirrors
+    // to the mirrors now, before a last close
+    struct repl_rec recs[batch_max];
+
+    if (!repl_on)
+        return;
+    pthread_mutex_lock(&repl_lock);
+    while (send_queued(recs))
+        ;
+    for (int unit=0; unit<MAXUNITS; unit++)
+    {
+        if (!mirrors[unit].target)
+            continue;
+        while (resync_track(unit))
+            ;   // Complete, unless the receiver is gone
+        if (mirrors[unit].marked)
+            FBS_LOG(G_ERROR, "Unit %d: mirror %s is %u tracks behind", unit,
+                    mirrors[unit].target, mirrors[unit].marked);
+    }
+    pthread_mutex_unlock(&repl_lock);
+}
+
+uint32_t repl_pending()
+{
+    // Tracks waiting for resync
+    uint32_t n = 0;
+
+    for (int unit=0; unit<MAXUNITS; unit++)
+        if (mirrors[unit].target)
+            n += atomic_load(&mirrors[unit].marked);
+    return n;
+}
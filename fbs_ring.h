@@ -0,0 +1,84 @@
+// FBS4000 - Future Backing Storage for RC4000 w. DRC401 and a BeagleBone (tm)
+// Lock-free single producer/single consumer ring of fixed size records
+//
+// The producer fills ring_put() and publishes it with ring_put_done(),
+// the consumer reads ring_get() and releases it with ring_get_done().
+// Neither side ever blocks or makes a syscall.
+
+#ifndef FBS_RING_H
+#define FBS_RING_H
+
+#include <stdint.h>
+#include <stdlib.h>
+#include <stdatomic.h>
+
+struct spsc_ring
+{
+    _Atomic uint32_t head;  // Written by producer
+    _Atomic uint32_t tail;  // Written by consumer
+    uint32_t size;          // Records, power of 2
+    uint32_t recsize;
+    char *buf;
+};
+
+static inline int ring_init(struct spsc_ring *r, uint32_t depth, uint32_t recsize)
+{
+    r->size = 1;
+    while (r->size < depth)
+        r->size <<= 1;
+    r->recsize = recsize;
+    atomic_init(&r->head, 0);
+    atomic_init(&r->tail, 0);
+    r->buf = calloc(r->size, recsize);
+    return r->buf != NULL;
+}
+
+static inline uint32_t ring_used(struct spsc_ring *r)
+{
+    return atomic_load_explicit(&r->head, memory_order_acquire) -
+           atomic_load_explicit(&r->tail, memory_order_acquire);
+}
+
+static inline void *ring_put(struct spsc_ring *r)
+{
+    // Free record or NULL if full
+    uint32_t head = atomic_load_explicit(&r->head, memory_order_relaxed);
+
+    if (head - atomic_load_explicit(&r->tail, memory_order_acquire) >= r->size)
+        return NULL;
+    return r->buf + (head & (r->size-1)) * r->recsize;
+}
+
+static inline void ring_put_done(struct spsc_ring *r)
+{
+    atomic_store_explicit(&r->head,
+                          atomic_load_explicit(&r->head, memory_order_relaxed) + 1,
+                          memory_order_release);
+}
+
+static inline void *ring_get(struct spsc_ring *r)
+{
+    // Oldest record or NULL if empty
+    uint32_t tail = atomic_load_explicit(&r->tail, memory_order_relaxed);
+
+    if (tail == atomic_load_explicit(&r->head, memory_order_acquire))
+        return NULL;
+    return r->buf + (tail & (r->size-1)) * r->recsize;
+}
+
+static inline void *ring_peek(struct spsc_ring *r, uint32_t i)
+{
+    // i'th oldest record, i < ring_used()
+    uint32_t tail = atomic_load_explicit(&r->tail, memory_order_relaxed);
+
+    return r->buf + ((tail + i) & (r->size-1)) * r->recsize;
+}
+
+static inline void ring_get_done(struct spsc_ring *r)
+{
+    atomic_store_explicit(&r->tail,
+                          atomic_load_explicit(&r->tail, memory_order_relaxed) + 1,
+                          memory_order_release);
+}
+
+#endif
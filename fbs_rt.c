@@ -0,0 +1,275 @@
+// FBS4000 - Future Backing Storage for RC4000 w. DRC401 and a BeagleBone (tm)
+// Real-time mode, cycle counter clock and per-phase latency histograms
+
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <unistd.h>
+#include <signal.h>
+#include <setjmp.h>
+#include <sched.h>
+#include <time.h>
+#include <sys/mman.h>
+#include "fbs.h"
+
+// Histograms are log-linear like HdrHistogram: 16 sub-buckets per power
+// of two, so every value is kept with better than 6.25% precision.
+#define HIST_SUB        16
+#define HIST_BUCKETS    ((32-3)*HIST_SUB)
+
+struct hist
+{
+    char *name;
+    uint32_t n;
+    uint32_t min;
+    uint32_t max;
+    uint64_t sum;
+    uint32_t count[HIST_BUCKETS];
+};
+
+static struct hist hists[H_PHASES] =
+{
+    {"rotation"}, {"window"}, {"fetch"}, {"flush"}, {"poll_dsa"}, {"encode"}
+};
+
+int hist_on = 0;
+int tick_pmu = 0;
+static uint32_t tick_ns16 = 1 << 16;     // ns per tick, 16.16 fixed point
+static volatile sig_atomic_t hist_request;
+static int rt_prio;         // FBS_RT, 0: not real-time
+static cpu_set_t all_cpus;  // Affinity before FBS_CPU
+
+uint32_t clock_ticks()
+{
+    // Fallback clock, ns
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000000u + ts.tv_nsec;
+}
+
+#if defined(__arm__)
+static sigjmp_buf probe_env;
+
+static void probe_sigill(int sig)
+{
+    siglongjmp(probe_env, 1);
+}
+
+static int pmu_probe()
+{
+    // PMCCNTR is only readable from user mode when the kernel has set
+    // PMUSERENR.EN. Enable the cycle counter if it is not running.
+    struct sigaction sa, old;
+    uint32_t r, t0, t1;
+    int ok = 0;
+
+    memset(&sa, 0, sizeof(sa));
+    sa.sa_handler = probe_sigill;
+    sigaction(SIGILL, &sa, &old);
+    if (!sigsetjmp(probe_env, 1))
+    {
+        asm volatile("mrc p15, 0, %0, c9, c14, 0" : "=r"(r));   // PMUSERENR
+        if (r & 1)
+        {
+            asm volatile("mrc p15, 0, %0, c9, c12, 0" : "=r"(r));   // PMCR
+            asm volatile("mcr p15, 0, %0, c9, c12, 0" :: "r"(r | 1));   // E
+            asm volatile("mcr p15, 0, %0, c9, c12, 1" :: "r"(1u << 31)); // PMCNTENSET.C
+            asm volatile("mrc p15, 0, %0, c9, c13, 0" : "=r"(t0));
+            usleep(1000);
+            asm volatile("mrc p15, 0, %0, c9, c13, 0" : "=r"(t1));
+            ok = t1 != t0;
+        }
+    }
+    sigaction(SIGILL, &old, NULL);
+    return ok;
+}
+#endif
+
+static void tick_calibrate()
+{
+    // ns per tick against CLOCK_MONOTONIC
+    uint32_t t0, t1, c0, c1;
+
+    c0 = clock_ticks();
+    t0 = fbs_ticks();
+    usleep(20000);
+    c1 = clock_ticks();
+    t1 = fbs_ticks();
+    if (t1 != t0)
+        tick_ns16 = ((uint64_t)(c1 - c0) << 16) / (t1 - t0);
+}
+
+static void hist_sigusr1(int sig)
+{
+    hist_request = 1;
+}
+
+void rt_init()
+{
+    char *par;
+    struct sched_param sp;
+    cpu_set_t cpus;
+
+#if defined(__arm__)
+    tick_pmu = pmu_probe();
+#endif
+    tick_calibrate();
+    FBS_LOG(G_MISC, "Clock: %s, %.3f ns/tick",
+#if defined(__arm__)
+            tick_pmu ? "PMCCNTR" : "CLOCK_MONOTONIC",
+#elif defined(__x86_64__) || defined(__i386__)
+            "TSC",
+#else
+            "CLOCK_MONOTONIC",
+#endif
+            tick_ns16 / 65536.0);
+
+    if (sched_getaffinity(0, sizeof(all_cpus), &all_cpus))
+        abend("sched_getaffinity");
+    if ((par = getenv("FBS_CPU")) != NULL)
+    {
+        CPU_ZERO(&cpus);
+        CPU_SET(atoi(par), &cpus);
+        if (sched_setaffinity(0, sizeof(cpus), &cpus))
+            abend("sched_setaffinity");
+        FBS_LOG(G_MISC, "Pinned to CPU %d", atoi(par));
+    }
+    if ((par = getenv("FBS_RT")) != NULL && atoi(par) > 0)
+    {
+        // Only the drum thread, the writer stays SCHED_OTHER
+        sp.sched_priority = rt_prio = atoi(par);
+        if (sched_setscheduler(0, SCHED_FIFO, &sp))
+            abend("sched_setscheduler");
+        FBS_LOG(G_MISC, "RT mode: SCHED_FIFO priority %d", sp.sched_priority);
+        hist_on = 1;
+    }
+    if ((par = getenv("FBS_HIST")) != NULL)
+        hist_on = atoi(par);
+    if (hist_on)
+    {
+        for (int h=0; h<H_PHASES; h++)
+            hists[h].min = ~0;
+        signal(SIGUSR1, hist_sigusr1);
+    }
+}
+
+void rt_background()
+{
+    // In a thread started by the drum thread after rt_init(): back to
+    // SCHED_OTHER on any CPU, only the drum loop runs SCHED_FIFO
+    struct sched_param sp = {0};
+
+    if (sched_setscheduler(0, SCHED_OTHER, &sp))
+        abend("sched_setscheduler");
+    if (CPU_COUNT(&all_cpus) && sched_setaffinity(0, sizeof(all_cpus), &all_cpus))
+        abend("sched_setaffinity");
+}
+
+void rt_lock()
+{
+    // RT mode, the drum loop's buffers are allocated: lock them and the
+    // stack in memory. Mappings made later, like the images, are not.
+    volatile uint8_t stack[64*1024];
+
+    if (!rt_prio)
+        return;
+    for (size_t i=0; i<sizeof(stack); i+=4096)
+        stack[i] = 0;
+    if (mlockall(MCL_CURRENT))
+        abend("mlockall");
+}
+
+static int hist_bucket(uint32_t v)
+{
+    int e;
+
+    if (v < HIST_SUB)
+        return v;
+    e = 31 - __builtin_clz(v);
+    return (e-3)*HIST_SUB + ((v >> (e-4)) & (HIST_SUB-1));
+}
+
+static uint32_t bucket_value(int b)
+{
+    // Lowest value in bucket b
+    if (b < HIST_SUB)
+        return b;
+    return (HIST_SUB + b % HIST_SUB) << (b/HIST_SUB - 1);
+}
+
+uint32_t ticks_ns(uint32_t ticks)
+{
+    return ((uint64_t)ticks * tick_ns16) >> 16;
+}
+
+uint32_t ns_ticks(uint32_t ns)
+{
+    return ((uint64_t)ns << 16) / tick_ns16;
+}
+
+void hist_add(int h, uint32_t ticks)
+{
+    struct hist *p = &hists[h];
+    uint32_t ns = ticks_ns(ticks);
+
+    p->count[hist_bucket(ns)]++;
+    p->n++;
+    p->sum += ns;
+    if (ns < p->min)
+        p->min = ns;
+    if (ns > p->max)
+        p->max = ns;
+}
+
+static uint32_t percentile(struct hist *p, double pct)
+{
+    uint32_t want = p->n * pct / 100.0;
+    uint32_t seen = 0;
+
+    for (int b=0; b<HIST_BUCKETS; b++)
+        if ((seen += p->count[b]) > want)
+            return bucket_value(b);
+    return p->max;
+}
+
+void hist_dump()
+{
+    // Percentiles to syslog, all buckets to FBS_HISTFILE
+    char *fname = getenv("FBS_HISTFILE");
+    FILE *f = NULL;
+    struct hist *p;
+
+    if (fname && (f = fopen(fname, "w")) == NULL)
+        FBS_LOG(G_ERROR, "Cannot write %s", fname);
+    for (int h=0; h<H_PHASES; h++)
+    {
+        p = &hists[h];
+        if (!p->n)
+            continue;
+        FBS_LOG(G_STAT, "%-8s n %u min %u avg %u p50 %u p99 %u p99.9 %u max %u ns",
+                p->name, p->n, p->min, (uint32_t)(p->sum / p->n), percentile(p, 50),
+                percentile(p, 99), percentile(p, 99.9), p->max);
+        if (f)
+        {
+            fprintf(f, "# %s n %u min %u max %u\n", p->name, p->n, p->min, p->max);
+            for (int b=0; b<HIST_BUCKETS; b++)
+                if (p->count[b])
+                    fprintf(f, "%s %u %u\n", p->name, bucket_value(b), p->count[b]);
+        }
+    }
+    if (f)
+        fclose(f);
+}
+
+void hist_poll()
+{
+    // Writer thread: dump requested by SIGUSR1, away from the drum loop
+    if (hist_request)
+    {
+        hist_request = 0;
+        hist_dump();
+    }
+}
@@ -0,0 +1,156 @@
+// FBS4000 - Future Backing Storage for RC4000 w. DRC401 and a BeagleBone (tm)
+// Budgeted tasks in the slack at the end of each rotation
+//
+// Between word 267 of sector 3 and word 0 of sector 0 the drum loop has
+// time for chores that must stay out of the bit cells. How much is measured
+// by main_loop(): the sector transfers of a rotation take longer at times,
+// and a rotation that was quicker leaves the difference for the tasks.
+// Every task declares a worst case cost. sched_run() dispatches the due
+// tasks, in table order, that fit in what is left of that slack, counted
+// from the end of sector 3. A task that took longer than its cost gets
+// what it took as its new cost, which decays back to the declared cost
+// as long as the task keeps within it. Idle tasks only run in rotations
+// without transfers. A task skipped for 16 of its periods is overdue and
+// goes before the others, but it still has to fit.
+//
+// The slack can be close to 0 on a drum whose rotations all take the same
+// time. Queueing written sectors for the writer must not wait for slack,
+// so writeback and flush have a limit: that many rotations after their
+// last run they run regardless. Writeback is every rotation with the
+// journal (written sectors reach it within a rotation), else every 16;
+// flush every 128, as before there were budgets. Both only copy sectors
+// of the track cache to the writer ring: writeback one track, flush at
+// most FBS_TRCACHE tracks, and neither waits when the ring is full.
+//
+// Work that blocks in the kernel does not belong here, it goes to the
+// writer thread (img_idle()).
+
+#include <stdio.h>
+#include <stdint.h>
+#include "fbs.h"
+
+#define SCHED_OVERDUE   16      // Periods skipped before a task goes first
+
+struct sched_task
+{
+    char *name;
+    void (*run)();
+    uint32_t decl_us;   // Declared worst case
+    uint32_t period;    // Rotations
+    int idle;           // Only in rotations without transfers
+    uint32_t limit;     // Rotations, then it runs without slack, 0: never
+    uint32_t cost_us;   // Current estimate, at least decl_us
+    uint32_t last;      // trackcnt of the last run
+    uint32_t runs;
+    uint32_t skips;     // Due, but did not fit the budget
+    uint32_t overdue;   // Runs as overdue
+    uint32_t limited;   // Runs at the limit, past the budget
+    uint32_t max_ns;
+};
+
+static void writeback()
+{
+    uint32_t t0 = 0;
+
+    HIST_START(t0);
+    if (journal_on)
+        trcache_flush();    // Written sectors reach the journal every rotation
+    else
+        trcache_writeback();
+    HIST_END(H_FLUSH, t0);
+}
+
+static struct sched_task tasks[] =
+{
+    // name        run            decl_us period idle limit
+    {"writeback", writeback,        20,   1, 0,  16},
+    {"flush",     trcache_flush,    60, 128, 0, 128},  // Don't let written data get stuck in track cache
+    {"expand",    track_expand,     30,   1, 0},
+    {"prefetch",  trcache_prefetch, 30,   1, 0},
+    {"snapshot",  snap_point,        5,   1, 0},  // Queues the track cache when requested
+    {"scrub",     trcache_scrub,     5,   1, 1},
+    {NULL}
+};
+
+static uint32_t slack_sum;  // Ticks, all rotations
+static uint32_t slack_top;  // Ticks, most in a rotation
+static uint32_t used_max;   // Ticks used, worst rotation
+static uint32_t rotations;
+
+void sched_init()
+{
+    for (struct sched_task *t = tasks; t->name; t++)
+    {
+        t->cost_us = t->decl_us;
+        if (t->run == writeback && journal_on)
+            t->limit = 1;
+    }
+}
+
+static int at_limit(struct sched_task *t)
+{
+    return t->limit && trackcnt - t->last >= t->limit;
+}
+
+static int due(struct sched_task *t, int pass)
+{
+    // pass 0: the overdue tasks and those at their limit, pass 1: the others
+    if (trackcnt - t->last < t->period)
+        return 0;
+    return (trackcnt - t->last >= SCHED_OVERDUE * t->period || at_limit(t)) == !pass;
+}
+
+void sched_run(uint32_t t_start, uint32_t slack, int idle)
+{
+    // End of rotation, t_start: fbs_ticks() at the end of sector 3,
+    // slack: ticks from there the tasks may use
+    struct sched_task *t;
+    uint32_t now = fbs_ticks();
+    uint32_t used = now - t_start;
+    uint32_t ns;
+    int fits;
+
+    rotations++;
+    slack_sum += ticks_ns(slack) / 1000;
+    if (slack > slack_top)
+        slack_top = slack;
+    for (int pass=0; pass<2; pass++)
+        for (t = tasks; t->name; t++)
+        {
+            if (!due(t, pass) || (t->idle && !idle))
+                continue;
+            fits = used + ns_ticks(t->cost_us * 1000) <= slack;
+            if (!fits && !at_limit(t))
+            {
+                t->skips++;
+                continue;
+            }
+            t->overdue += trackcnt - t->last >= SCHED_OVERDUE * t->period;
+            t->limited += !fits;
+            t->run();
+            t->last = trackcnt;
+            t->runs++;
+            ns = ticks_ns(fbs_ticks() - now);
+            now = fbs_ticks();
+            used = now - t_start;
+            if (ns > t->max_ns)
+                t->max_ns = ns;
+            if (ns > t->cost_us * 1000)
+                t->cost_us = (ns + 999) / 1000;
+            else
+                t->cost_us -= (t->cost_us - t->decl_us) / 8;
+        }
+    if (used > used_max)
+        used_max = used;
+}
+
+void sched_report()
+{
+    FBS_LOG(G_STAT, "Rotation slack: avg %u us, max %u us, max used %u us",
+            rotations ? slack_sum / rotations : 0, ticks_ns(slack_top) / 1000,
+            ticks_ns(used_max) / 1000);
+    for (struct sched_task *t = tasks; t->name; t++)
+        FBS_LOG(G_STAT, "Task %-9s runs %u skipped %u overdue %u limit %u max %u us, cost %u us",
+                t->name, t->runs, t->skips, t->overdue, t->limited,
+                (t->max_ns + 999) / 1000, t->cost_us);
+}
@@ -0,0 +1,673 @@
+// FBS4000 - Future Backing Storage for RC4000 w. DRC401 and a BeagleBone (tm)
+// Simulated DRC401 for the FBS_SIM GPIO backend
+//
+// The GPIO banks are plain memory. Every store from the drum loop ends in
+// sim_gpio_stored(), which plays the DRC401 side: it counts RDCLK edges,
+// samples RDDATA and INDEX, and drives SRRQ/SRDATA/CPDSA/WE/WRDATA into the
+// DATAIN registers before the drum loop samples them again.
+// A small RC4000 model issues read and write transfers, or with
+// FBS_REPLAY=<file> the RC4000 side of a bus recording (fbs_record.c) is
+// played back sector by sector.
+//
+// FBS_SIM_MIX picks the model's load:
+//   random     Random unit, segment, 1-8 segments, read or write (default)
+//   seq        Each transfer starts where the last one ended
+//   write      As random, 4 of 5 transfers write
+//   switch     Units in turn, 1-2 segments
+// The model keeps its own copy of the images: reads are checked against
+// it, and at the end every segment of the images is compared with it.
+// The time from the DSA to the first data frame of every transfer is
+// reported as a distribution.
+// With FBS_SIM_CYCLES=n, +25V goes off after every FBS_SIM_ROTATIONS and
+// comes back FBS_SIM_OFF_MS later, n times on in all. The time from +25V
+// back to the first INDEX is the reconnect latency.
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <time.h>
+#include "fbs.h"
+#include "fbs_sim.h"
+
+#define FRAME_CELLS     (SECT_WORDS*24)
+#define INDEX_CELL      (257*24 + 3)    // INDEX pulse, word 257 of sector 3
+#define CPDSA_CELL      (257*24 + 8)    // DRC pulses CPDSA here after a transfer
+#define ADDR_WORD       258             // Address word compared with the DSA
+#define SEEK_TIMEOUT    12              // Frames to wait for a segment
+
+#define REG(bank, reg)  regs[bank][(reg)/4]
+
+// RC4000 side states
+#define S_IDLE  0
+#define S_SEEK  1   // DSA in shift register, not yet read by FBS
+#define S_WAIT  2   // Waiting for the segment to come around
+#define S_XFER  3
+
+enum { MIX_RANDOM, MIX_SEQ, MIX_WRITE, MIX_SWITCH };
+static const char *mix_name[] = {"random", "seq", "write", "switch", NULL};
+
+#define LAT_FRAMES  32  // Seek to data histogram, frames
+
+static uint32_t regs[MAX_GPIO_BANKS][AM335X_GPIO_SIZE/4];
+static uint32_t lastout[MAX_GPIO_BANKS];
+
+static FILE *replay;
+static uint32_t *shadow[MAXUNITS];  // Packed, what the images should hold
+static struct rec_hdr rhdr;
+static uint32_t replayed;
+
+static struct
+{
+    int power;              // +25V
+    uint32_t max_rot;       // Power is dropped after this many rotations
+    uint32_t snap_rot;      // A snapshot is requested after this many, 0: none
+    uint32_t cycles;        // Power on periods after this one
+    uint32_t off_ms;
+    uint32_t cycle_rot;     // Rotations when this period started
+    int back;               // Power comes back at t_back
+    struct timespec t_back;
+    uint32_t seed;
+    int synced;             // INDEX seen
+    uint32_t cell;          // Bit cell within frame
+    uint32_t rdsr;          // Read data shift register
+    uint32_t sr;            // DSA shift register
+    int srrq;
+
+    int state;
+    int unit;               // Current transfer
+    uint32_t seg;
+    int count;
+    int write;
+    int wait;               // Frames waited for the segment
+
+    int xfer;               // This frame transfers seg
+    int wrframe;            // ... and it is a write
+    int next_xfer;
+    int next_wr;
+    uint32_t addr;          // Address word of the segment in transfer
+    uint32_t rdparity;
+    uint32_t wrdata[257];   // Data + parity for the write frame
+    uint32_t w267;          // Address echo before a write frame
+    uint32_t rddata[257];   // Received in a read frame
+
+    int mix;
+    uint32_t next_seg;      // MIX_SEQ
+    uint32_t turn;          // MIX_SWITCH
+    struct timespec t_dsa;  // DSA loaded, no data frame yet
+    uint64_t dsa_frame;
+    int seeking;
+
+    // Statistics
+    uint32_t rotations;
+    uint64_t frames;
+    uint64_t cells;
+    uint32_t ops;
+    uint32_t rd_sectors;
+    uint32_t wr_sectors;
+    uint32_t rd_errors;
+    uint32_t wr_errors;
+    uint32_t seek_timeouts;
+    uint32_t sync_errors;
+    uint32_t reconnects;
+    uint32_t rd_mismatches; // Read data not as last written
+    uint32_t lat_frames[LAT_FRAMES+1];
+    uint32_t *lat_us;       // Per transfer
+    uint32_t lat_n, lat_size;
+    double rc_min, rc_max, rc_sum;  // s
+    double off;             // s, +25V off to INDEX
+    struct timespec t0, t1;
+} drc;
+
+static uint32_t sim_rand()
+{   // xorshift32
+    drc.seed ^= drc.seed << 13;
+    drc.seed ^= drc.seed >> 17;
+    drc.seed ^= drc.seed << 5;
+    return drc.seed;
+}
+
+static void pin(int bank, int bit, int val)
+{
+    if (val)
+        REG(bank, AM335X_GPIO_DATAIN) |= 1 << bit;
+    else
+        REG(bank, AM335X_GPIO_DATAIN) &= ~(1 << bit);
+}
+
+static uint32_t addrword(uint32_t seg)
+{   // Same as the address words in fetch_track
+    return ((seg & 0x7FF) << 8) | 0x80000000;
+}
+
+static double elapsed(struct timespec t1, struct timespec t0)
+{
+    return (t1.tv_sec - t0.tv_sec) + (t1.tv_nsec - t0.tv_nsec) * 1e-9;
+}
+
+static void load_sr(uint32_t sr)
+{
+    // RC4000 writes the DSA shift register
+    drc.sr = sr;
+    drc.srrq = 1;
+    pin(GP_SRRQ_BANK, GP_SRRQ_BIT, 1);
+    pin(GP_SRDATA_BANK, GP_SRDATA_BIT, drc.sr & 1);
+}
+
+static void image_sector(int unit, uint32_t seg, uint32_t *file)
+{
+    // Packed data of a segment in the image
+    const uint32_t *p = img_drum_track(unit, seg >> 2);
+
+    if (p)
+        decode_sector(file, p + (seg&3)*SECT_WORDS);
+    else
+        memcpy(file, img_track(unit, seg >> 2) + (seg&3)*192, 768);
+}
+
+static void shadow_init()
+{
+    // At the first INDEX, the images as they are
+    for (int unit=0; unit<MAXUNITS; unit++)
+    {
+        if (!unit_segs[unit])
+            continue;
+        if (!(shadow[unit] = malloc((size_t)unit_segs[unit]*768)))
+            abend("shadow_init");
+        for (uint32_t seg=0; seg<unit_segs[unit]; seg++)
+            image_sector(unit, seg, shadow[unit] + seg*192);
+    }
+}
+
+static void next_op()
+{
+    // Next transfer of the mix, on units that have an image
+    int units[MAXUNITS];
+    int n = 0;
+
+    for (int unit=0; unit<MAXUNITS; unit++)
+        if (unit_segs[unit])
+            units[n++] = unit;
+    if (!n)
+        return;
+    switch (drc.mix)
+    {
+    case MIX_SEQ:
+        drc.unit = units[0];
+        drc.count = 1 + sim_rand() % 8;
+        if (drc.count > unit_segs[drc.unit])
+            drc.count = unit_segs[drc.unit];
+        drc.seg = drc.next_seg + drc.count <= unit_segs[drc.unit] ? drc.next_seg : 0;
+        drc.next_seg = drc.seg + drc.count;
+        drc.write = sim_rand() & 1;
+        break;
+    case MIX_SWITCH:
+        drc.unit = units[drc.turn++ % n];
+        drc.count = 1 + sim_rand() % 2;
+        if (drc.count > unit_segs[drc.unit])
+            drc.count = unit_segs[drc.unit];
+        drc.seg = sim_rand() % (unit_segs[drc.unit] - drc.count + 1);
+        drc.write = sim_rand() & 1;
+        break;
+    default:
+        drc.unit = units[sim_rand() % n];
+        drc.count = 1 + sim_rand() % 8;
+        if (drc.count > unit_segs[drc.unit])
+            drc.count = unit_segs[drc.unit];
+        drc.seg = sim_rand() % (unit_segs[drc.unit] - drc.count + 1);
+        drc.write = drc.mix == MIX_WRITE ? sim_rand() % 5 != 0 : sim_rand() & 1;
+    }
+    drc.wait = 0;
+
+    load_sr((drc.unit << 17) | drc.seg);
+    drc.state = S_SEEK;
+    clock_gettime(CLOCK_MONOTONIC, &drc.t_dsa);
+    drc.dsa_frame = drc.frames;
+    drc.seeking = 1;
+}
+
+static void seek_done()
+{
+    // First data frame of a transfer
+    struct timespec now;
+    uint64_t frames = drc.frames - drc.dsa_frame;
+
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    drc.seeking = 0;
+    drc.lat_frames[frames < LAT_FRAMES ? frames : LAT_FRAMES]++;
+    if (drc.lat_n == drc.lat_size)
+    {
+        drc.lat_size = drc.lat_size ? 2*drc.lat_size : 4096;
+        if (!(drc.lat_us = realloc(drc.lat_us, drc.lat_size*4)))
+            abend("seek_done");
+    }
+    drc.lat_us[drc.lat_n++] = elapsed(now, drc.t_dsa) * 1e6;
+}
+
+static void power_off()
+{
+    drc.power = 0;
+    clock_gettime(CLOCK_MONOTONIC, &drc.t1);
+}
+
+static void replay_start()
+{
+    // At INDEX: the unit, DSA and WE the recording started with
+    load_sr(rhdr.sr);
+    drc.next_wr = rhdr.we;
+    drc.w267 = rhdr.w267;
+    pin(GP_WE_BANK, GP_WE_BIT, !drc.next_wr);
+}
+
+static void replay_frame()
+{
+    // Next recorded sector
+    uint8_t flags;
+    uint32_t sr;
+
+    drc.next_xfer = drc.next_wr = 0;
+    if (!drc.power)
+        return;
+    if (fread(&flags, 1, 1, replay) != 1)
+    {
+        power_off();
+        return;
+    }
+    replayed++;
+    drc.xfer = (flags & REC_CPDSA) != 0;
+    drc.wrframe = (flags & REC_DATA) != 0;
+    if ((flags & REC_DSA) && fread(&sr, 4, 1, replay) == 1)
+        load_sr(sr);
+    if ((flags & REC_WE) && fread(&drc.w267, 4, 1, replay) == 1)
+        drc.next_wr = 1;
+    if ((flags & REC_DATA) && fread(drc.wrdata, 4, 257, replay) != 257)
+        power_off();
+    pin(GP_WE_BANK, GP_WE_BIT, !drc.next_wr);
+    if (drc.wrframe)
+        drc.wr_sectors++;
+    else
+    if (drc.xfer)
+        drc.rd_sectors++;
+    if (flags & REC_POWER)
+        power_off();
+}
+
+static void sim_frame()
+{
+    // Start of a new frame (sector)
+    drc.frames++;
+    if (replay)
+    {
+        replay_frame();
+        return;
+    }
+    drc.xfer = drc.next_xfer;
+    drc.wrframe = drc.next_wr;
+    drc.next_xfer = drc.next_wr = 0;
+    drc.rdparity = 0;
+    if (drc.xfer && drc.seeking)
+        seek_done();
+    if (drc.state == S_IDLE && drc.power)
+        next_op();
+}
+
+static void sim_word(uint32_t idx, uint32_t w)
+{
+    // Complete 24-bit word received on RDDATA (left aligned like trbuf)
+    if (replay)
+        return;
+    if (drc.xfer && !drc.wrframe && idx < 257)
+    {
+        drc.rddata[idx] = w;
+        if (idx < 256)
+            drc.rdparity ^= w;
+        else
+        {
+            uint32_t file[192];
+
+            if (w != (drc.rdparity ^ drc.addr))
+                drc.rd_errors++;
+            decode_sector(file, drc.rddata);
+            if (shadow[drc.unit] && memcmp(file, shadow[drc.unit] + drc.seg*192, 768))
+                drc.rd_mismatches++;
+        }
+    }
+    if (drc.xfer && drc.wrframe && idx == 256 && shadow[drc.unit])
+        decode_sector(shadow[drc.unit] + drc.seg*192, drc.wrdata);  // All sent
+    if (idx != ADDR_WORD || drc.state == S_IDLE)
+        return;
+    if (drc.state == S_SEEK)
+    {
+        if (drc.srrq)
+            return;  // DSA not read yet
+        drc.state = S_WAIT;
+    }
+    if (drc.xfer)
+    {   // CPDSA was pulsed in word 257
+        if (drc.wrframe)
+            drc.wr_sectors++;
+        else
+            drc.rd_sectors++;
+        drc.seg++;
+        if (!--drc.count)
+        {
+            drc.ops++;
+            drc.state = S_IDLE;
+            pin(GP_WE_BANK, GP_WE_BIT, 1);
+            return;
+        }
+    }
+    if (w == addrword(drc.seg))
+    {   // Next frame is ours
+        drc.state = S_XFER;
+        drc.next_xfer = 1;
+        drc.addr = w;
+        if (drc.write)
+        {
+            uint32_t parity = 0;
+            for (int i=0; i<256; i++)
+                parity ^= (drc.wrdata[i] = sim_rand() << 8);
+            drc.wrdata[256] = parity ^ w;
+            drc.w267 = w;
+            drc.next_wr = 1;
+        }
+    }
+    else
+    if (++drc.wait > SEEK_TIMEOUT)
+    {
+        drc.seek_timeouts++;
+        drc.state = S_IDLE;
+        drc.seeking = 0;
+    }
+    pin(GP_WE_BANK, GP_WE_BIT, !drc.next_wr);  // WE is inverted
+}
+
+static int wr_bit(uint32_t cell)
+{
+    // Write data sampled by FBS before the rising edge of cell
+    uint32_t w = cell / 24;
+
+    if (w < 257 && drc.wrframe)
+        return (drc.wrdata[w] >> (31 - cell % 24)) & 1;
+    if (w == 267 && drc.next_wr)
+        return (drc.w267 >> (31 - cell % 24)) & 1;
+    return 0;
+}
+
+static void sim_cell(uint32_t out)
+{
+    // Rising edge on RDCLK
+    uint32_t prev;
+    struct timespec now;
+
+    if (drc.back)
+    {
+        clock_gettime(CLOCK_MONOTONIC, &now);
+        if (elapsed(now, drc.t_back) >= 0)
+        {
+            drc.power = 1;
+            drc.back = 0;
+        }
+    }
+    if (!(out & (1 << GP_INDEX_BIT)) && (drc.synced || drc.power))
+    {   // INDEX is active low at the GPIO
+        if (!drc.synced && !drc.rotations)
+        {
+            drc.synced = 1;
+            drc.frames = 3;
+            clock_gettime(CLOCK_MONOTONIC, &drc.t0);
+            if (replay)
+                replay_start();
+            else
+                shadow_init();
+        }
+        else
+        if (!drc.synced)
+        {   // Reconnected after a power cycle
+            double rc;
+
+            drc.synced = 1;
+            clock_gettime(CLOCK_MONOTONIC, &now);
+            rc = elapsed(now, drc.t_back);
+            drc.off += elapsed(now, drc.t1);
+            if (!drc.reconnects++ || rc < drc.rc_min)
+                drc.rc_min = rc;
+            if (rc > drc.rc_max)
+                drc.rc_max = rc;
+            drc.rc_sum += rc;
+        }
+        else
+        if (drc.cell != INDEX_CELL)
+            drc.sync_errors++;
+        drc.cell = INDEX_CELL;
+        if (++drc.rotations == drc.snap_rot)
+            snap_request();
+        if (drc.rotations - drc.cycle_rot >= drc.max_rot && drc.power && !replay)
+            power_off();
+    }
+    if (drc.synced)
+    {
+        drc.cells++;
+        // RDDATA is inverted by the 74LS02 and delayed one cell
+        drc.rdsr = (drc.rdsr << 1) | !(out & (1 << GP_RDDATA_BIT));
+        prev = drc.cell ? drc.cell - 1 : FRAME_CELLS - 1;
+        if (prev % 24 == 23)
+            sim_word(prev / 24, drc.rdsr << 8);
+    }
+
+    // CPDSA is sampled after this cell, WRDATA before the next
+    pin(GP_CPDSA_BANK, GP_CPDSA_BIT, !drc.power || (drc.xfer && drc.cell == CPDSA_CELL));
+    if (!drc.synced)
+        return;
+    if (++drc.cell == FRAME_CELLS)
+    {
+        drc.cell = 0;
+        sim_frame();
+    }
+    pin(GP_WRDATA_BANK, GP_WRDATA_BIT, wr_bit(drc.cell));
+}
+
+void sim_gpio_stored(int bank)
+{
+    uint32_t out;
+
+    // SET/CLEARDATAOUT act on DATAOUT like on the AM335x
+    if (REG(bank, AM335X_GPIO_SETDATAOUT))
+    {
+        REG(bank, AM335X_GPIO_DATAOUT) |= REG(bank, AM335X_GPIO_SETDATAOUT);
+        REG(bank, AM335X_GPIO_SETDATAOUT) = 0;
+    }
+    if (REG(bank, AM335X_GPIO_CLEARDATAOUT))
+    {
+        REG(bank, AM335X_GPIO_DATAOUT) &= ~REG(bank, AM335X_GPIO_CLEARDATAOUT);
+        REG(bank, AM335X_GPIO_CLEARDATAOUT) = 0;
+    }
+    out = REG(bank, AM335X_GPIO_DATAOUT);
+
+    if (bank == GP_SRCLK_BANK && (lastout[bank] & ~out & (1 << GP_SRCLK_BIT)))
+    {   // SRCLK is inverted by IC4C, GPIO 1->0 shifts the DSA register
+        drc.srrq = 0;
+        pin(GP_SRRQ_BANK, GP_SRRQ_BIT, 0);
+        drc.sr >>= 1;
+        pin(GP_SRDATA_BANK, GP_SRDATA_BIT, drc.sr & 1);
+    }
+    if (bank == GP_CONN_BANK && drc.synced && drc.power &&
+        (lastout[bank] & ~out & (1 << GP_CONN_BIT)))
+        drc.wr_errors++;  // FBS signals a write error by dropping CONN
+    if (bank == GP_RDCLK_BANK && (~lastout[bank] & out & (1 << GP_RDCLK_BIT)))
+        sim_cell(out);
+    lastout[bank] = out;
+}
+
+void sim_gpio_map()
+{
+    char *par;
+
+    for (int bank=0; bank<MAX_GPIO_BANKS; bank++)
+        gpio_addr[bank] = regs[bank];
+    pin(GP_WE_BANK, GP_WE_BIT, 1);
+    drc.power = 1;
+    drc.max_rot = 2000;
+    if ((par = getenv("FBS_SIM_ROTATIONS")) != NULL)
+        drc.max_rot = strtoul(par, NULL, 0);
+    if ((par = getenv("FBS_SIM_SNAP")) != NULL)
+        drc.snap_rot = strtoul(par, NULL, 0);
+    if ((par = getenv("FBS_SIM_MIX")) != NULL)
+    {
+        for (drc.mix = 0; mix_name[drc.mix] && strcmp(par, mix_name[drc.mix]); drc.mix++)
+            ;
+        if (!mix_name[drc.mix])
+            abend("Error in FBS_SIM_MIX (random, seq, write or switch)");
+    }
+    drc.cycles = 1;
+    if ((par = getenv("FBS_SIM_CYCLES")) != NULL)
+        drc.cycles = strtoul(par, NULL, 0);
+    drc.cycles -= drc.cycles > 0;
+    drc.off_ms = 50;
+    if ((par = getenv("FBS_SIM_OFF_MS")) != NULL)
+        drc.off_ms = strtoul(par, NULL, 0);
+    drc.seed = 4000;
+    if ((par = getenv("FBS_SIM_SEED")) != NULL)
+        drc.seed = strtoul(par, NULL, 0) | 1;
+    if ((par = getenv("FBS_REPLAY")) != NULL)
+    {
+        if ((replay = fopen(par, "r")) == NULL)
+            abend("Cannot open FBS_REPLAY");
+        if (fread(&rhdr, sizeof(rhdr), 1, replay) != 1 ||
+            rhdr.magic != REC_MAGIC || rhdr.version != REC_VERSION)
+            abend("FBS_REPLAY is not a bus recording");
+        FBS_LOG(G_MISC, "SIM: Replaying %s", par);
+    }
+}
+
+int sim_power_back()
+{
+    // Power fault seen by the drum loop: 0 if that was the last power cycle,
+    // else +25V comes back after FBS_SIM_OFF_MS
+    if (!drc.cycles || replay)
+        return 0;
+    drc.cycles--;
+    drc.state = S_IDLE;
+    drc.xfer = drc.wrframe = drc.next_xfer = drc.next_wr = 0;
+    drc.seeking = 0;
+    drc.srrq = 0;
+    pin(GP_SRRQ_BANK, GP_SRRQ_BIT, 0);
+    pin(GP_WE_BANK, GP_WE_BIT, 1);
+    drc.synced = 0;
+    drc.cycle_rot = drc.rotations;
+    drc.t_back = drc.t1;
+    drc.t_back.tv_nsec += drc.off_ms % 1000 * 1000000;
+    drc.t_back.tv_sec += drc.off_ms / 1000 + drc.t_back.tv_nsec / 1000000000;
+    drc.t_back.tv_nsec %= 1000000000;
+    drc.back = 1;
+    return 1;
+}
+
+static int cmp_u32(const void *a, const void *b)
+{
+    return *(uint32_t *)a < *(uint32_t *)b ? -1 : *(uint32_t *)a > *(uint32_t *)b;
+}
+
+static uint32_t lat_frames_pct(uint32_t pct)
+{
+    // Frames within which pct % of the transfers got to their data
+    uint32_t n = 0;
+    uint32_t f;
+
+    for (f = 0; f < LAT_FRAMES; f++)
+        if ((n += drc.lat_frames[f]) * 100ull >= (uint64_t)drc.lat_n * pct)
+            break;
+    return f;
+}
+
+static uint32_t verify()
+{
+    // Segments of the images that are not as the model wrote them
+    uint32_t file[192];
+    uint32_t bad = 0, segs = 0;
+
+    for (int unit=0; unit<MAXUNITS; unit++)
+    {
+        if (!shadow[unit] || !img[unit])
+            continue;
+        for (uint32_t seg=0; seg<unit_segs[unit]; seg++)
+        {
+            image_sector(unit, seg, file);
+            if (memcmp(file, shadow[unit] + seg*192, 768) && !bad++)
+                FBS_LOG(G_ERROR, "SIM: Unit %d segment %u is not as written", unit, seg);
+        }
+        segs += unit_segs[unit];
+    }
+    FBS_LOG(bad ? G_ERROR : G_STAT, "SIM: Verify: %u segments compared, %u differ, %u reads not as written",
+            segs, bad, drc.rd_mismatches);
+    return bad + drc.rd_mismatches;
+}
+
+uint32_t sim_report()
+{
+    // With the images still mapped, 0 if the images verify
+    double secs = elapsed(drc.t1, drc.t0) - drc.off;
+    uint32_t crc, errors = 0;
+
+    FBS_LOG(G_STAT, "SIM: %u rotations, %llu sectors, %u transfers in %.3f s",
+                    drc.rotations, (unsigned long long)drc.frames, drc.ops, secs);
+    FBS_LOG(G_STAT, "SIM: %.0f sectors/s on the drum, %.0f read + %.0f written sectors/s",
+                    drc.frames / secs, drc.rd_sectors / secs, drc.wr_sectors / secs);
+    FBS_LOG(G_STAT, "SIM: %.1f ns/bit, %.1f us/rotation",
+                    secs * 1e9 / drc.cells, secs * 1e6 / drc.rotations);
+    FBS_LOG(G_STAT, "SIM: Read parity errors: %u Write errors: %u Seek timeouts: %u Sync errors: %u",
+                    drc.rd_errors, drc.wr_errors, drc.seek_timeouts, drc.sync_errors);
+    if (!replay)
+        FBS_LOG(G_STAT, "SIM: Mix %s: %.0f segments/s transferred, %u read + %u written",
+                mix_name[drc.mix], (drc.rd_sectors + drc.wr_sectors) / secs, drc.rd_sectors, drc.wr_sectors);
+    if (drc.lat_n)
+    {
+        uint32_t n = drc.lat_n;
+
+        qsort(drc.lat_us, n, 4, cmp_u32);
+        FBS_LOG(G_STAT, "SIM: Seek to data, %u transfers: p50 %u p90 %u p99 %u max %u us,"
+                " p50 %u p90 %u p99 %u frames",
+                n, drc.lat_us[n/2], drc.lat_us[n*9/10], drc.lat_us[n*99/100], drc.lat_us[n-1],
+                lat_frames_pct(50), lat_frames_pct(90), lat_frames_pct(99));
+        for (uint32_t f=0; f<=LAT_FRAMES; f++)
+            if (drc.lat_frames[f])
+                FBS_LOG(G_STAT, "SIM:   %s%2u frames %7u %5.1f%%", f == LAT_FRAMES ? ">=" : "  ", f,
+                        drc.lat_frames[f], drc.lat_frames[f] * 100.0 / n);
+    }
+    if (replay)
+        FBS_LOG(G_STAT, "SIM: Replayed %u sectors, %.0f sectors/s", replayed, replayed / secs);
+    if (drc.reconnects)
+        FBS_LOG(G_STAT, "SIM: %u power cycles, +25V back to INDEX min %.3f avg %.3f max %.3f ms",
+                drc.reconnects, drc.rc_min * 1e3, drc.rc_sum * 1e3 / drc.reconnects, drc.rc_max * 1e3);
+    if (imgstat.dirtied)
+        FBS_LOG(G_STAT, "SIM: Image I/O: %llu KB stored, %llu KB written in %u writes",
+                (unsigned long long)imgstat.dirtied/1024, (unsigned long long)imgstat.written/1024,
+                imgstat.writes);
+    if (repl_on)
+        FBS_LOG(G_STAT, "SIM: Mirror: %u sectors queued, %u sent in %u batches, lag %u, %u tracks resynced",
+                replstat.queued, replstat.sent, replstat.batches, replstat.lag, replstat.resynced);
+    for (int unit=0; unit<MAXUNITS; unit++)
+    {
+        if (!img[unit])
+            continue;
+        crc = 0;
+        for (uint32_t track=0; track<unit_segs[unit]/4; track++)
+        {
+            const uint32_t *trk = img_drum_track(unit, track);
+            uint32_t file[768];
+
+            if (!trk)
+            {
+                crc = fbs_crc32(crc, img_track(unit, track), 768*4);
+                continue;
+            }
+            for (int sect=0; sect<4; sect++)    // Same crc as the packed image
+                decode_sector(file + sect*192, trk + sect*SECT_WORDS);
+            crc = fbs_crc32(crc, file, 768*4);
+        }
+        FBS_LOG(G_STAT, "SIM: Unit %d image crc32: %08x", unit, crc);
+    }
+    if (!replay)
+        errors = verify();
+    return errors;
+}
@@ -0,0 +1,10 @@
+// FBS4000 - Future Backing Storage for RC4000 w. DRC401 and a BeagleBone (tm)
+// Simulated DRC401 for the FBS_SIM GPIO backend
+
+#ifndef FBS_SIM_H
+#define FBS_SIM_H
+
+uint32_t sim_report();
+int sim_power_back();
+
+#endif
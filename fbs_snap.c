@@ -0,0 +1,269 @@
+// FBS4000 - Future Backing Storage for RC4000 w. DRC401 and a BeagleBone (tm)
+// Point-in-time snapshots of all units, while the drum keeps running
+//
+// kill -USR2 <fbs> requests a snapshot. At the end of the next rotation
+// snap_point() queues every dirty sector in the track cache for the
+// writer and notes the last sequence number queued: the snapshot is the
+// images once the writer has stored that sector, and nothing after it.
+// If the writer ring is full it tries again the next rotation.
+//
+// The writer arms the snapshot at that point, before it stores the next
+// sector. From then on a track is copied to the snapshot file just
+// before it is first overwritten (img_store_sector, img_store_drum), and
+// a background thread copies all the other tracks. A snapshot costs
+// only the tracks overwritten while it is taken twice, the rest is read
+// once. The snapshot of unit n goes to UNITn_SNAP, default <image>.snap,
+// in the format of the image. It is written as <file>.tmp and renamed
+// when complete, so the file is always a whole snapshot.
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <signal.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <time.h>
+#include <sys/resource.h>
+#include <sys/syscall.h>
+#include "fbs.h"
+
+enum { SNAP_IDLE, SNAP_DUE, SNAP_ON };
+
+struct snap_unit
+{
+    char *name;             // NULL: unit not open
+    char *tmp;
+    int fd;
+    int drum;
+    uint32_t tracks;
+    uint8_t *copied;        // Per track, SNAP_ON
+};
+
+static struct snap_unit snaps[MAXUNITS];
+static volatile sig_atomic_t requested;
+static _Atomic int state = SNAP_IDLE;
+static uint32_t snap_seq;   // Last sector in the snapshot
+static struct timespec t_point;    // Snapshot point
+static uint32_t cow;        // Tracks copied on write, this snapshot
+static pthread_mutex_t snap_lock = PTHREAD_MUTEX_INITIALIZER;  // snaps[], state but SNAP_IDLE to SNAP_DUE
+struct snap_stats snapstat;
+
+static uint32_t since_point_us()
+{
+    struct timespec now;
+
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (now.tv_sec - t_point.tv_sec) * 1000000 + (now.tv_nsec - t_point.tv_nsec) / 1000;
+}
+
+static void snap_sigusr2(int sig)
+{
+    requested = 1;
+}
+
+void snap_init()
+{
+    signal(SIGUSR2, snap_sigusr2);
+}
+
+void snap_request()
+{
+    requested = 1;
+}
+
+void snap_open(int unit, char *sname, char *fname)
+{
+    // Where snapshots of an image just opened go
+    struct snap_unit *s = &snaps[unit];
+
+    if (sname)
+        s->name = strdup(sname);
+    else if ((s->name = malloc(strlen(fname) + 6)) != NULL)
+        sprintf(s->name, "%s.snap", fname);
+    if (!s->name || !(s->tmp = malloc(strlen(s->name) + 5)))
+        abend("snap_open");
+    sprintf(s->tmp, "%s.tmp", s->name);
+    s->drum = img_drum_track(unit, 0) != NULL;
+    s->tracks = unit_segs[unit] / 4;
+}
+
+void snap_close(int unit)
+{
+    // The image is about to be unmapped: cancel a snapshot not yet armed,
+    // the writer may never get to it, and let one armed finish
+    struct snap_unit *s = &snaps[unit];
+
+    if (!s->name)
+        return;
+    pthread_mutex_lock(&snap_lock);
+    if (atomic_load(&state) == SNAP_DUE)
+    {
+        unlink(s->tmp);
+        atomic_store(&state, SNAP_IDLE);
+        FBS_LOG(G_ERROR, "Unit %d closed, snapshot cancelled", unit);
+    }
+    pthread_mutex_unlock(&snap_lock);
+    while (atomic_load(&state) == SNAP_ON)
+        usleep(1000);
+    free(s->name);
+    free(s->tmp);
+    s->name = s->tmp = NULL;
+}
+
+void snap_point()
+{
+    // Drum loop, end of rotation: take a requested snapshot here
+    if (!requested)
+        return;
+    if (atomic_load(&state) != SNAP_IDLE)
+    {
+        requested = 0;
+        FBS_LOG(G_ERROR, "Snapshot already in progress, request ignored");
+        return;
+    }
+    trcache_flush();
+    if (trcache_dirty())
+        return;     // Writer ring full, next rotation
+    requested = 0;
+    snap_seq = writer_seq();
+    clock_gettime(CLOCK_MONOTONIC, &t_point);
+    snapstat.taken++;
+    atomic_store(&state, SNAP_DUE);
+}
+
+static void copy_track(int unit, uint32_t track)
+{
+    // Track as it is in the image to the snapshot, once. snap_lock held.
+    struct snap_unit *s = &snaps[unit];
+    const void *p;
+    size_t len;
+    off_t pos;
+
+    if (s->copied[track])
+        return;
+    if (s->drum)
+    {
+        p = img_drum_track(unit, track);
+        len = DRUM_TRACK_WORDS*4;
+        pos = DRUM_HDR_SIZE + (off_t)track*len;
+    }
+    else
+    {
+        p = img_track(unit, track);
+        len = 768*4;
+        pos = (off_t)track*len;
+    }
+    if (pwrite(s->fd, p, len, pos) != len)
+        abend("pwrite, snapshot");
+    s->copied[track] = 1;
+}
+
+static void *snap_copier(void *arg)
+{
+    // The tracks not copied on write, then the files
+    uint32_t n = 0;
+
+    setpriority(PRIO_PROCESS, syscall(SYS_gettid), 10);
+    for (int unit=0; unit<MAXUNITS; unit++)
+    {
+        if (!snaps[unit].copied)
+            continue;
+        for (uint32_t track=0; track<snaps[unit].tracks; track++)
+        {
+            pthread_mutex_lock(&snap_lock);
+            if (!snaps[unit].copied[track])
+            {
+                copy_track(unit, track);
+                n++;
+            }
+            pthread_mutex_unlock(&snap_lock);
+        }
+    }
+    for (int unit=0; unit<MAXUNITS; unit++)
+    {
+        struct snap_unit *s = &snaps[unit];
+
+        if (!s->copied)
+            continue;
+        if (fdatasync(s->fd) || close(s->fd) || rename(s->tmp, s->name))
+            abend("Cannot complete snapshot");
+        FBS_LOG(G_MISC, "Unit %d: snapshot %s", unit, s->name);
+    }
+    snapstat.copied += n;
+    FBS_LOG(G_STAT, "Snapshot complete in %u ms: %u tracks copied, %u on write",
+            since_point_us() / 1000, n + cow, cow);
+
+    pthread_mutex_lock(&snap_lock);
+    for (int unit=0; unit<MAXUNITS; unit++)
+    {
+        free(snaps[unit].copied);
+        snaps[unit].copied = NULL;
+    }
+    atomic_store(&state, SNAP_IDLE);
+    pthread_mutex_unlock(&snap_lock);
+    return NULL;
+}
+
+static void snap_arm()
+{
+    // Writer thread, at the snapshot point
+    struct drum_hdr h = {DRUM_MAGIC};
+    pthread_t tid;
+
+    for (int unit=0; unit<MAXUNITS; unit++)
+    {
+        struct snap_unit *s = &snaps[unit];
+
+        if (!s->name)
+            continue;
+        if ((s->fd = open(s->tmp, O_WRONLY|O_CREAT|O_TRUNC, 0644)) < 0)
+            abend("Cannot create snapshot");
+        if (ftruncate(s->fd, (s->drum ? DRUM_HDR_SIZE : 0) + (off_t)s->tracks*(s->drum ? DRUM_TRACK_WORDS*4 : 768*4)))
+            abend("ftruncate, snapshot");
+        if (s->drum)
+        {
+            h.version = DRUM_VERSION;
+            h.tracks = s->tracks;
+            h.track_words = DRUM_TRACK_WORDS;
+            if (pwrite(s->fd, &h, sizeof(h), 0) != sizeof(h))
+                abend("pwrite, snapshot");
+        }
+        if (!(s->copied = calloc(s->tracks, 1)))
+            abend("snap_arm");
+    }
+    cow = 0;
+    FBS_LOG(G_MISC, "Snapshot armed, %u us after its point", since_point_us());
+    atomic_store(&state, SNAP_ON);
+    if (pthread_create(&tid, NULL, snap_copier, NULL))
+        abend("pthread_create, snapshot");
+    pthread_detach(tid);
+}
+
+void snap_writer(uint32_t stored)
+{
+    // Writer thread: sectors up to stored are in the images, none after
+    if (atomic_load(&state) != SNAP_DUE || (int32_t)(stored - snap_seq) < 0)
+        return;
+    pthread_mutex_lock(&snap_lock);
+    if (atomic_load(&state) == SNAP_DUE)    // Not cancelled by snap_close()
+        snap_arm();
+    pthread_mutex_unlock(&snap_lock);
+}
+
+void snap_cow(int unit, uint32_t seg)
+{
+    // Writer thread: segment is about to be stored
+    if (atomic_load(&state) != SNAP_ON)
+        return;
+    pthread_mutex_lock(&snap_lock);
+    if (atomic_load(&state) == SNAP_ON && snaps[unit].copied && !snaps[unit].copied[seg >> 2])
+    {
+        copy_track(unit, seg >> 2);
+        snapstat.cow++;
+        cow++;
+    }
+    pthread_mutex_unlock(&snap_lock);
+}
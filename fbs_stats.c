@@ -0,0 +1,94 @@
+// FBS4000 - Future Backing Storage for RC4000 w. DRC401 and a BeagleBone (tm)
+// Statistics segment in POSIX shared memory, read by fbsstat
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <time.h>
+#include <sys/mman.h>
+#include "fbs.h"
+
+struct fbs_stats stats;     // Counted by the drum loop
+static struct fbs_stats *shm;
+
+void stats_init()
+{
+    // Create the segment named by FBS_SHM, empty: no segment
+    char *name = getenv("FBS_SHM");
+    int fd;
+
+    stats.magic = FBS_STATS_MAGIC;
+    stats.version = FBS_STATS_VERSION;
+    stats.size = sizeof(stats);
+    stats.pid = getpid();
+    stats.started = time(NULL);
+    stats.unit = -1;
+    stats.rot_min = ~0;
+
+    if (!name)
+        name = FBS_STATS_SHM;
+    if (!*name)
+        return;
+    if ((fd = shm_open(name, O_CREAT | O_RDWR, 0644)) < 0 ||
+        ftruncate(fd, sizeof(*shm)) < 0 ||
+        (shm = mmap(NULL, sizeof(*shm), PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0)) == MAP_FAILED)
+    {
+        FBS_LOG(G_ERROR, "Cannot create stats segment %s", name);
+        shm = NULL;
+        if (fd >= 0)
+            close(fd);
+        return;
+    }
+    close(fd);
+
+    // Readers check magic and version, write them around the body
+    shm->magic = 0;
+    atomic_store(&shm->seq, 0);
+    stats_write(shm, &stats);
+    shm->version = stats.version;
+    shm->size = stats.size;
+    atomic_thread_fence(memory_order_release);
+    shm->magic = stats.magic;
+    FBS_LOG(G_MISC, "Stats segment: %s", name);
+}
+
+void stats_publish()
+{
+    // Plain stores, no syscalls: cheap enough for every rotation
+    if (!shm)
+        return;
+    stats.dsa = dsa;
+    stats.unit = selected_unit;
+    for (int unit=0; unit<MAXUNITS; unit++)
+        stats.segs[unit] = unit_segs[unit];
+    stats.tc_hits = trstat.hits;
+    stats.tc_misses = trstat.misses;
+    stats.tc_evictions = trstat.evictions;
+    stats.tc_dirty_evictions = trstat.dirty_evictions;
+    stats.tc_writebacks = trstat.writebacks;
+    stats.tc_prefetches = trstat.prefetches;
+    stats.tc_pf_hits = trstat.pf_hits;
+    stats.tc_pf_misses = trstat.pf_misses;
+    stats.wr_queued = wrstat.queued;
+    stats.wr_full = wrstat.full;
+    stats.wr_maxdepth = wrstat.maxdepth;
+    stats.wr_waits = wrstat.waits;
+    stats.io_dirtied = imgstat.dirtied;
+    stats.io_written = imgstat.written;
+    stats.io_writes = imgstat.writes;
+    stats.sum_checked = sumstat.checked;
+    stats.sum_passes = sumstat.passes;
+    stats.sum_errors = sumstat.errors;
+    stats.sum_unit = sum_on ? sumstat.unit : -1;
+    stats.sum_track = sumstat.track;
+    stats.repl_queued = replstat.queued;
+    stats.repl_sent = replstat.sent;
+    stats.repl_batches = replstat.batches;
+    stats.repl_lag = replstat.lag;
+    stats.repl_resynced = replstat.resynced;
+    stats.repl_pending = repl_on ? repl_pending() : 0;
+    stats_write(shm, &stats);
+}
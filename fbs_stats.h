@@ -0,0 +1,119 @@
+// FBS4000 - Future Backing Storage for RC4000 w. DRC401 and a BeagleBone (tm)
+// Statistics published in POSIX shared memory, shared by fbs and fbsstat
+//
+// The drum loop counts in a private copy and publishes it once per rotation
+// under a seqlock: seq is odd while the segment is being written. Readers
+// copy the struct and retry if seq was odd or changed meanwhile.
+// Bump FBS_STATS_VERSION on any change to the layout.
+
+#ifndef FBS_STATS_H
+#define FBS_STATS_H
+
+#include <stdint.h>
+#include <string.h>
+#include <stddef.h>
+#include <stdatomic.h>
+
+#define FBS_STATS_SHM       "/fbs4000"
+#define FBS_STATS_MAGIC     0x46425334  // FBS4
+#define FBS_STATS_VERSION   8
+#define FBS_STATS_UNITS     4
+
+struct fbs_stats
+{
+    uint32_t magic;
+    uint32_t version;
+    uint32_t size;          // sizeof(struct fbs_stats)
+    _Atomic uint32_t seq;   // Seqlock, odd: update in progress
+
+    uint32_t pid;
+    uint32_t started;       // time() at startup
+
+    // Drum state
+    uint32_t power;         // +25V on
+    uint32_t connected;
+    int32_t unit;           // Selected unit, -1: none
+    uint32_t dsa;
+    uint32_t power_cycles;
+    uint32_t connect_us;    // +25V on to connected, last power cycle
+    uint32_t connect_cold_us;   // Last with the images opened and LED test
+    uint32_t connect_warm_us;   // Last from warm standby
+    uint32_t connect_warm_max_us;
+    uint32_t warm_connects;
+
+    // Rotations, us
+    uint32_t rotations;
+    uint32_t rot_last;
+    uint32_t rot_min;
+    uint32_t rot_max;
+    uint64_t rot_sum;
+
+    // Drum traffic
+    uint32_t seeks;         // Track changes
+    uint32_t unit_selects;
+    uint32_t seek_errors;   // Track outside the unit
+    uint32_t wr_faults;     // Write check failed
+    uint32_t reads[FBS_STATS_UNITS];    // Sectors
+    uint32_t writes[FBS_STATS_UNITS];
+    uint32_t segs[FBS_STATS_UNITS];     // Unit size, 0: offline
+
+    // Track cache and writer
+    uint32_t tc_hits;
+    uint32_t tc_misses;
+    uint32_t tc_evictions;
+    uint32_t tc_dirty_evictions;
+    uint32_t tc_writebacks;
+    uint32_t tc_prefetches;
+    uint32_t tc_pf_hits;
+    uint32_t tc_pf_misses;
+    uint32_t wr_queued;
+    uint32_t wr_full;
+    uint32_t wr_maxdepth;
+    uint32_t wr_waits;
+    uint64_t io_dirtied;    // Explicit I/O units, bytes
+    uint64_t io_written;
+    uint32_t io_writes;
+    uint32_t sum_checked;   // Scrubber, tracks
+    uint32_t sum_passes;
+    uint32_t sum_errors;    // Segments
+    int32_t sum_unit;       // Position, -1: no sums
+    uint32_t sum_track;
+    uint32_t repl_queued;   // Mirror, sectors
+    uint32_t repl_sent;
+    uint32_t repl_batches;
+    uint32_t repl_lag;
+    uint32_t repl_resynced; // Tracks
+    uint32_t repl_pending;
+
+    uint32_t trace_lost;    // Trace ring full
+};
+
+// Everything after the header is published
+#define STATS_BODY  offsetof(struct fbs_stats, pid)
+
+static inline void stats_write(struct fbs_stats *shm, struct fbs_stats *st)
+{
+    // Publish st, plain stores between the seq updates
+    uint32_t seq = atomic_load_explicit(&shm->seq, memory_order_relaxed);
+
+    atomic_store_explicit(&shm->seq, seq + 1, memory_order_relaxed);
+    atomic_thread_fence(memory_order_release);
+    memcpy((char *)shm + STATS_BODY, (char *)st + STATS_BODY, sizeof(*st) - STATS_BODY);
+    atomic_store_explicit(&shm->seq, seq + 2, memory_order_release);
+}
+
+static inline void stats_read(struct fbs_stats *st, struct fbs_stats *shm)
+{
+    // Consistent copy of shm
+    uint32_t seq;
+
+    do
+    {
+        while ((seq = atomic_load_explicit(&shm->seq, memory_order_acquire)) & 1)
+            ;
+        memcpy(st, shm, sizeof(*st));
+        atomic_thread_fence(memory_order_acquire);
+    } while (atomic_load_explicit(&shm->seq, memory_order_relaxed) != seq);
+}
+
+#endif
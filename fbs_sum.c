@@ -0,0 +1,211 @@
+// FBS4000 - Future Backing Storage for RC4000 w. DRC401 and a BeagleBone (tm)
+// Sector checksums in a sidecar file, and a background scrubber
+//
+// With FBS_SUM=1 every unit image gets <image>.sum: a header and the
+// CRC-32 of every segment as it is stored in the image (768 bytes packed,
+// 257 words in drum format). img_store_sector() and img_store_drum()
+// update it, in the writer thread. The sum file is mapped and msync'ed
+// with the image.
+//
+// When the writer is idle, sum_scrub() checks the tracks of every unit in
+// turn against their sums, at most FBS_SCRUB tracks per second (default
+// 16). A sum file that is new or does not match the image is filled in
+// by the scrubber first, from memory; tracks below hdr->valid have sums.
+// The tracks checked are read from the file on the card, not from the
+// copy the drum uses (img_read_card()): with O_DIRECT, or on a file
+// system without it after dropping the cached pages, which does not drop
+// pages the drum has mapped. A track stored with explicit I/O is skipped
+// until it is written back.
+//
+// Without the journal the image and the sum file reach the card
+// independently. After a crash or power loss, a segment stored shortly
+// before shows up as a checksum error just like corruption does. With
+// the journal, replay stores the segment and its sum again.
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include "fbs.h"
+
+#define SUM_MAGIC       "FBS4SUM"
+#define SUM_VERSION     1
+
+struct sum_hdr
+{
+    char magic[8];
+    uint32_t version;
+    uint32_t segs;
+    uint32_t valid;     // Tracks with sums
+    uint32_t pad[3];
+    uint32_t crc[];     // Per segment
+};
+
+int sum_on = 0;
+static uint32_t scrub_rate = 16;
+static struct sum_hdr *sums[MAXUNITS];
+static size_t sum_size[MAXUNITS];
+static uint32_t credit;         // Tracks, << 16
+static uint32_t last;
+struct sum_stats sumstat;
+
+void sum_init()
+{
+    char *par;
+
+    if ((par = getenv("FBS_SUM")) != NULL)
+        sum_on = atoi(par);
+    if ((par = getenv("FBS_SCRUB")) != NULL)
+        scrub_rate = atoi(par);
+    if (sum_on)
+        FBS_LOG(G_MISC, "Sector checksums, scrub %u tracks/s", scrub_rate);
+}
+
+static uint32_t sect_crc(const uint32_t *track, int drum, int sect)
+{
+    // CRC of a sector of a track as stored in the image
+    if (drum)
+        return fbs_crc32(0, track + sect*SECT_WORDS, 257*4);
+    return fbs_crc32(0, track + sect*(768/4), 768);
+}
+
+static uint32_t seg_crc(int unit, uint32_t seg)
+{
+    // CRC of a segment as the drum has it
+    const uint32_t *p = img_drum_track(unit, seg >> 2);
+
+    return p ? sect_crc(p, 1, seg&3) : sect_crc(img_track(unit, seg >> 2), 0, seg&3);
+}
+
+void sum_open(int unit, char *fname)
+{
+    // Map <fname>.sum, start over if it is not for this image.
+    // Before the journal is replayed, replayed sectors update it.
+    char sname[strlen(fname) + 5];
+    struct sum_hdr *h;
+    struct stat sb;
+    size_t size = sizeof(struct sum_hdr) + unit_segs[unit]*4;
+    int fd;
+
+    if (!sum_on)
+        return;
+    sprintf(sname, "%s.sum", fname);
+    if ((fd = open(sname, O_RDWR | O_CREAT, 0644)) < 0)
+        abend("Cannot open sum file");
+    if (fstat(fd, &sb) == -1)
+        abend("fstat, sum file");
+    if (sb.st_size != size && ftruncate(fd, size))
+        abend("ftruncate, sum file");
+    h = mmap(NULL, size, PROT_READ|PROT_WRITE, MAP_SHARED, fd, 0);
+    close(fd);
+    if (h == MAP_FAILED)
+        abend("mmap, sum file");
+    if (sb.st_size != size || memcmp(h->magic, SUM_MAGIC, 8) ||
+        h->version != SUM_VERSION || h->segs != unit_segs[unit] || h->valid > unit_segs[unit]/4)
+    {
+        memcpy(h->magic, SUM_MAGIC, 8);
+        h->version = SUM_VERSION;
+        h->segs = unit_segs[unit];
+        h->valid = 0;
+        FBS_LOG(G_MISC, "Unit %d: new sum file %s", unit, sname);
+    }
+    else if (h->valid < h->segs/4)
+        FBS_LOG(G_MISC, "Unit %d: %s has sums for %u of %u tracks", unit, sname, h->valid, h->segs/4);
+    sums[unit] = h;
+    sum_size[unit] = size;
+}
+
+void sum_store(int unit, uint32_t seg)
+{
+    // Writer thread: segment stored in the image
+    if (sums[unit])
+        sums[unit]->crc[seg] = seg_crc(unit, seg);
+}
+
+void sum_sync(int unit)
+{
+    if (sums[unit] && msync(sums[unit], sum_size[unit], MS_SYNC))
+        abend("msync, sum file");
+}
+
+void sum_close(int unit)
+{
+    if (!sums[unit])
+        return;
+    sum_sync(unit);
+    munmap(sums[unit], sum_size[unit]);
+    sums[unit] = NULL;
+}
+
+static void scrub_track(int unit, uint32_t track)
+{
+    struct sum_hdr *h = sums[unit];
+    uint32_t card[DRUM_TRACK_WORDS];
+    int drum = img_drum_track(unit, 0) != NULL;
+    uint32_t seg, crc;
+    int r = 0;
+
+    if (track < h->valid && (r = img_read_card(unit, track, card)) <= 0)
+    {
+        if (r < 0)
+        {
+            sumstat.errors += 4;
+            FBS_LOG(G_ERROR, "Unit %d track %u: read error", unit, track);
+        }
+        return;     // Not on the card yet, checked next pass
+    }
+    for (seg = track*4; seg < track*4+4; seg++)
+    {
+        if (track >= h->valid)
+            h->crc[seg] = seg_crc(unit, seg);
+        else if ((crc = sect_crc(card, drum, seg&3)) != h->crc[seg])
+        {
+            sumstat.errors++;
+            FBS_LOG(G_ERROR, "Unit %d segment %u: checksum %08x, expected %08x",
+                    unit, seg, crc, h->crc[seg]);
+        }
+    }
+    if (track >= h->valid)
+        h->valid = track + 1;
+    else
+        sumstat.checked++;
+}
+
+void sum_scrub()
+{
+    // Writer thread, idle: check the next tracks, FBS_SCRUB per second
+    uint32_t now = clock_ticks();
+    uint32_t ms = (now - last) / 1000000;
+    uint32_t tracks;
+
+    if (!sum_on || !scrub_rate || !ms)
+        return;
+    last = now;
+    credit += (uint64_t)(ms < 1000 ? ms : 1000) * (scrub_rate << 16) / 1000;
+    if (credit > (scrub_rate << 16) / 10 + (1 << 16))
+        credit = (scrub_rate << 16) / 10 + (1 << 16);  // Burst after a busy spell
+    for (; credit >= 1 << 16; credit -= 1 << 16)
+    {
+        for (int i=0; i<MAXUNITS && !sums[sumstat.unit]; i++)
+        {
+            sumstat.unit = (sumstat.unit + 1) % MAXUNITS;
+            sumstat.track = 0;
+        }
+        if (!sums[sumstat.unit])
+            return;
+        tracks = unit_segs[sumstat.unit] / 4;
+        scrub_track(sumstat.unit, sumstat.track);
+        if (++sumstat.track == tracks)
+        {
+            sumstat.passes++;
+            FBS_LOG(G_STAT, "Unit %d: scrub pass done, %u tracks, %u checksum errors so far",
+                    sumstat.unit, tracks, sumstat.errors);
+            sumstat.unit = (sumstat.unit + 1) % MAXUNITS;
+            sumstat.track = 0;
+        }
+    }
+}
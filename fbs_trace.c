@@ -0,0 +1,149 @@
+// FBS4000 - Future Backing Storage for RC4000 w. DRC401 and a BeagleBone (tm)
+// Binary trace log for the drum loop
+//
+// syslog() is a blocking socket write. In the drum loop FBS_TRACE only
+// stores a timestamp, event id and up to 7 integer args in a preallocated
+// SPSC ring; a nice'd drainer thread formats them to syslog or to
+// FBS_TRACEFILE. If the ring is full the event is dropped and counted.
+// The drum loop thread is the only producer.
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <sys/resource.h>
+#include <sys/syscall.h>
+#include "fbs.h"
+#include "fbs_ring.h"
+
+struct trace_rec
+{
+    uint32_t ts;        // fbs_ticks()
+    uint16_t ev;
+    uint16_t nargs;
+    uint32_t args[TRACE_ARGS];
+};
+
+static const char *trace_fmt[EV_COUNT] =
+{
+    [EV_UNIT_SELECT]  = "Unit select: %d",
+    [EV_UNIT_OFFLINE] = "OFFLINE Unit select: %d",
+    [EV_NEW_DSA]      = "Tr: %d New Unit, DSA: %d %d",
+    [EV_INCR_DSA]     = "Tr: %d Incr DSA: %d",
+    [EV_WRITE_ERROR]  = "Tr: %d WRITE ERROR Segm: %d Addr: %08x Exp: %08x Parity: %08x Exp: %08x  W257: %08x",
+    [EV_WRITE_DATA]   = "Tr: %d Write data: Sector: %d Data[0..1]: %06X %06X",
+    [EV_POWER_FAULT]  = "DRC POWER FAULT(%d)",
+    [EV_ROTATION]     = "Min/max/avg rotation time: %d/%d/%d us",
+    [EV_TRCACHE]      = "Track cache hit/miss/evict: %u/%u/%u Writeback in window: %u Prefetch/hit/miss: %u/%u/%u",
+    [EV_WRITER]       = "Writer queued/ring full/max depth/waits: %u/%u/%u/%u",
+    [EV_SCRUB]        = "SCRUB: Parity error unit %u track %u sector %u, written: %u",
+};
+
+static struct spsc_ring ring;
+static int tracing = 0;
+static _Atomic uint32_t lost;
+static FILE *tracefile;
+static pthread_t drainer_tid;
+
+static void emit(const char *fmt, uint32_t *a, double t)
+{
+    if (tracefile)
+    {
+        fprintf(tracefile, "%12.6f ", t);
+        fprintf(tracefile, fmt, a[0], a[1], a[2], a[3], a[4], a[5], a[6]);
+        fputc('\n', tracefile);
+    }
+    else
+        syslog(LOG_INFO, fmt, a[0], a[1], a[2], a[3], a[4], a[5], a[6]);
+}
+
+static void *drainer(void *arg)
+{
+    struct trace_rec *r;
+    uint32_t last_ts = fbs_ticks();
+    uint32_t reported = 0;
+    uint32_t n;
+    uint64_t ns = 0;    // Since trace_init, if drained before the clock wraps
+
+    setpriority(PRIO_PROCESS, syscall(SYS_gettid), 19);
+    while (1)
+    {
+        if ((n = atomic_load_explicit(&lost, memory_order_relaxed)) != reported)
+        {
+            uint32_t a[TRACE_ARGS] = {n - reported};
+
+            emit("Trace: %u events lost", a, ns / 1e9);
+            reported = n;
+        }
+        if ((r = ring_get(&ring)) == NULL)
+        {
+            usleep(10000);
+            continue;
+        }
+        ns += ticks_ns(r->ts - last_ts);
+        last_ts = r->ts;
+        emit(trace_fmt[r->ev], r->args, ns / 1e9);
+        if (tracefile && ring_used(&ring) == 1)
+            fflush(tracefile);  // Before trace_flush() can see the ring empty
+        ring_get_done(&ring);
+    }
+    return NULL;
+}
+
+void trace_init()
+{
+    char *par;
+    uint32_t depth = 4096;
+
+    if ((par = getenv("FBS_TRACE")) != NULL && !atoi(par))
+        return;     // syslog() directly, as FBS_LOG
+    if ((par = getenv("FBS_TRACERING")) != NULL)
+    {
+        depth = strtoul(par, NULL, 0);
+        if (depth < 16) abend("Error in FBS_TRACERING (at least 16 events)");
+    }
+    if ((par = getenv("FBS_TRACEFILE")) != NULL && !(tracefile = fopen(par, "a")))
+        abend("Cannot open FBS_TRACEFILE");
+    if (!ring_init(&ring, depth, sizeof(struct trace_rec)))
+        abend("trace_init");
+    if (pthread_create(&drainer_tid, NULL, drainer, NULL))
+        abend("pthread_create, trace");
+    tracing = 1;
+    FBS_LOG(G_MISC, "Trace ring: %u events%s%s", ring.size,
+            tracefile ? " to " : "", tracefile ? par : "");
+}
+
+void trace_put(int ev, const uint32_t *args, int nargs)
+{
+    struct trace_rec *r;
+    uint32_t a[TRACE_ARGS] = {0};
+
+    if (!tracing)
+    {
+        memcpy(a, args, nargs*4);
+        syslog(LOG_INFO, trace_fmt[ev], a[0], a[1], a[2], a[3], a[4], a[5], a[6]);
+        return;
+    }
+    if ((r = ring_put(&ring)) == NULL)
+    {
+        atomic_store_explicit(&lost, ++stats.trace_lost, memory_order_relaxed);
+        return;
+    }
+    r->ts = fbs_ticks();
+    r->ev = ev;
+    r->nargs = nargs;
+    memcpy(r->args, args, nargs*4);
+    memset(r->args + nargs, 0, (TRACE_ARGS-nargs)*4);
+    ring_put_done(&ring);
+}
+
+void trace_flush()
+{
+    // Wait until the drainer has written everything, not in the drum loop
+    if (tracing)
+        while (ring_used(&ring))
+            usleep(1000);
+}
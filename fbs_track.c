@@ -0,0 +1,431 @@
+// FBS4000 - Future Backing Storage for RC4000 w. DRC401 and a BeagleBone (tm)
+// Track buffer: file data <-> DRC words, and the cache of encoded tracks
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include "fbs.h"
+
+// A cache slot holds one encoded track (4*268 24-bit words) with its own
+// dirty flags. trbuf/dirty point into the slot of the current track, so a
+// seek back to a cached track is a pointer swap. Dirty sectors are queued
+// for the writer outside the word 257-267 window. A slot is not reused
+// until the writer has stored its sectors, or the image would be stale.
+//
+// At the end of a rotation the track after the current one is encoded
+// into a clean slot (FBS_PREFETCH, default on), so a sequential transfer
+// crossing a track boundary finds it cached: the seek in the window is a
+// pointer swap instead of an encode.
+//
+// A seek to a track not cached only builds the address words in the
+// window. The data and parity of a sector are encoded by track_sector()
+// just before the sector is sent, one sector at a time.
+struct track_slot
+{
+    int unit;       // -1: free
+    uint32_t track;
+    uint32_t used;  // LRU stamp
+    uint32_t pending;   // Last sector queued for the writer, 0: none
+    int prefetched;     // Encoded ahead, not yet used
+    int ready[4];       // Data and parity encoded
+    int dirty[4];
+    int wave_ok[4];
+    uint32_t *wave;     // FBS_WAVEFORM: 4*268 words of WAVE_WORD
+    uint32_t buf[4*SECT_WORDS];
+};
+
+static struct track_slot *slots;
+static int nslots = 8;
+static struct track_slot *cur;
+static uint32_t usecnt;
+static int prefetch = 1;
+
+// Sent on seek error, makes sync. error on DRC
+static uint32_t nulltrack[4*SECT_WORDS];
+static int nulldirty[4];
+static int nullwave[4];
+
+uint32_t *trbuf = nulltrack;
+int *dirty = nulldirty;
+int *wave_ok = nullwave;
+struct trcache_stats trstat;
+
+void trcache_init()
+{
+    char *par;
+    int waveform = 0;
+
+    if ((par = getenv("FBS_TRCACHE")) != NULL)
+    {
+        nslots = strtoul(par, NULL, 0);
+        if (nslots < 1) abend("Error in FBS_TRCACHE (at least 1 track)");
+    }
+    slots = calloc(nslots, sizeof(struct track_slot));
+    if (!slots)
+        abend("trcache_init");
+    for (int i=0; i<nslots; i++)
+        slots[i].unit = -1;
+    if ((par = getenv("FBS_PREFETCH")) != NULL)
+        prefetch = atoi(par);
+    if (nslots < 2)
+        prefetch = 0;   // Would evict the current track
+    FBS_LOG(G_MISC, "Track cache: %d tracks%s", nslots, prefetch ? ", prefetch" : "");
+
+    if ((par = getenv("FBS_WAVEFORM")) != NULL)
+        waveform = atoi(par);
+    if (waveform)
+    {
+        for (int i=0; i<nslots; i++)
+            if (!(slots[i].wave = malloc(4*SECT_WORDS*WAVE_WORD*4)))
+                abend("trcache_init, waveform");
+        FBS_LOG(G_MISC, "Waveform: %d KB per track, %d KB total",
+                4*SECT_WORDS*WAVE_WORD*4/1024, nslots*4*SECT_WORDS*WAVE_WORD*4/1024);
+    }
+}
+
+static int slot_dirty(struct track_slot *s)
+{
+    return s->dirty[0] | s->dirty[1] | s->dirty[2] | s->dirty[3];
+}
+
+static void encode_addr(struct track_slot *s)
+{
+    // Words 257-267 of every sector, no sector encoded yet
+    uint32_t track = s->track;
+    uint32_t *trb;
+
+    for (int sect=0; sect<4; sect++)
+    {
+        // We keep the word numbering of the DRC...
+        trb = s->buf + sect*SECT_WORDS + 257;
+        for (int i=0; i<11; i++)
+            trb[i] = ((((track << 2) & 0x7FC) + ((sect+1)&3))<< 8) | 0x80000000; // See DRC018
+    }
+    bzero(s->ready, sizeof(s->ready));
+    bzero(s->dirty, sizeof(s->dirty));
+    bzero(s->wave_ok, sizeof(s->wave_ok));
+}
+
+static void encode_sect(struct track_slot *s, int sect)
+{
+    // Data and parity of a sector from file data, copied from a drum
+    // format image
+    const uint32_t *imgptr = img_drum_track(s->unit, s->track);
+    uint32_t *trb = s->buf + sect*SECT_WORDS;
+    uint32_t parity;
+
+    s->ready[sect] = 1;
+    if (imgptr)
+    {
+        memcpy(trb, imgptr + sect*SECT_WORDS, 257*4);
+        return;
+    }
+    imgptr = img_track(s->unit, s->track) + sect*(768/4);
+    parity = ((((s->track<<2) & 0x7FC) + sect) << 8) | 0x80000000;
+    trb[256] = encode_sector(trb, imgptr, parity);
+}
+
+static void encode_track(struct track_slot *s)
+{
+    // Build track image from file data
+    encode_addr(s);
+    for (int sect=0; sect<4; sect++)
+        encode_sect(s, sect);
+}
+
+void track_sector(int sect)
+{
+    // Encode sect of the current track if it has not been, before it is
+    // sent. Outside the word 257-267 window.
+    uint32_t t0 = 0;
+
+    if (!cur || cur->ready[sect])
+        return;
+    HIST_START(t0);
+    encode_sect(cur, sect);
+    HIST_END(H_ENCODE, t0);
+    trstat.lazy_encodes++;
+}
+
+static void expand_sector(struct track_slot *s, int sect)
+{
+    // Bank 2 bits for every bit cell of the sector's 268 words, as
+    // send_rcv_words and do_word_257_267 would compute them
+    uint32_t *trb = s->buf + sect*SECT_WORDS;
+    uint32_t *wv = s->wave + sect*SECT_WORDS*WAVE_WORD;
+    uint32_t val;
+
+    if (!s->ready[sect])
+        encode_sect(s, sect);
+    int32_t w;
+    // 1-bit delay line, starts with the last bit of the previous sector
+    int dlybit = !((s->buf[((sect+3)&3)*SECT_WORDS + 267] >> 8) & 1);
+
+    for (int i=0; i<SECT_WORDS; i++)
+    {
+        w = (int32_t)trb[i];
+        for (int j=0; j<24; j++)
+        {
+            val = (1<<GP_RDCLK_BIT) | (dlybit << GP_RDDATA_BIT) | (1<<GP_INDEX_BIT);
+            if (sect == 3 && i == 257 && j == 3)
+                val &= ~(1<<GP_INDEX_BIT);
+            *(wv++) = val;
+            *(wv++) = val & ~(1<<GP_RDCLK_BIT);
+            dlybit = (w>=0);
+            w += w;
+        }
+    }
+    s->wave_ok[sect] = 1;
+}
+
+uint32_t *track_wave(uint32_t *ptr)
+{
+    // Waveform for the word at ptr in trbuf, NULL if none
+    int ofs = ptr - trbuf;
+
+    if (!cur || !cur->wave || !cur->wave_ok[ofs/SECT_WORDS])
+        return NULL;
+    return cur->wave + ofs*WAVE_WORD;
+}
+
+void track_expand()
+{
+    // Expand one sector of the current track that has no valid waveform.
+    // Called at end of rotation, not in the word 257-267 window.
+    if (!cur || !cur->wave)
+        return;
+    for (int sect=0; sect<4; sect++)
+    {
+        if (!cur->wave_ok[sect])
+        {
+            expand_sector(cur, sect);
+            return;
+        }
+    }
+}
+
+static int flush_slot(struct track_slot *s, int wait)
+{
+    // Queue dirty sectors for the writer, return 0 if the ring is full
+    uint32_t seq;
+
+    for (int sect=0; sect<4; sect++)
+    {
+        if (s->dirty[sect])
+        {
+            seq = writer_put(s->unit, (s->track<<2) + sect, s->buf + sect*SECT_WORDS, wait);
+            if (!seq)
+                return 0;
+            s->pending = seq;
+            s->dirty[sect] = 0;
+        }
+    }
+    return 1;
+}
+
+static int slot_busy(struct track_slot *s)
+{
+    // Sectors of the slot still queued for the writer
+    if (s->pending && writer_done(s->pending))
+        s->pending = 0;
+    return s->pending != 0;
+}
+
+static struct track_slot *victim()
+{
+    // Free slot, else least recently used written back slot, else least recently used
+    struct track_slot *lru = NULL;
+    struct track_slot *clean = NULL;
+
+    for (struct track_slot *s = slots; s < slots+nslots; s++)
+    {
+        if (s->unit < 0)
+            return s;
+        if (!lru || s->used < lru->used)
+            lru = s;
+        if (!slot_dirty(s) && !slot_busy(s) && (!clean || s->used < clean->used))
+            clean = s;
+    }
+    return clean ? clean : lru;
+}
+
+static struct track_slot *lookup(int unit, uint32_t track)
+{
+    for (struct track_slot *s = slots; s < slots+nslots; s++)
+        if (s->unit == unit && s->track == track)
+            return s;
+    return NULL;
+}
+
+void fetch_track()
+{
+    // Point trbuf at the encoded track for dsa, encode it if not cached
+    uint32_t track = dsa >> 2;
+    struct track_slot *s;
+    int next = cur && cur->unit == selected_unit && cur->track + 1 == track;
+
+    seek_error = ((track+1) << 2) > unit_segs[selected_unit];
+    if (seek_error)
+    {
+        // seek error, make sync. error on DRC
+        cur = NULL;
+        trbuf = nulltrack;
+        dirty = nulldirty;
+        wave_ok = nullwave;
+        return;
+    }
+    if ((s = lookup(selected_unit, track)) != NULL)
+    {
+        trstat.hits++;
+        if (s->prefetched)
+            trstat.pf_hits++;
+        s->prefetched = 0;
+    }
+    else
+    {
+        trstat.misses++;
+        if (next && prefetch)
+            trstat.pf_misses++;
+        s = victim();
+        if (s->unit >= 0)
+        {
+            trstat.evictions++;
+            if (slot_dirty(s) || slot_busy(s))
+            {   // Cache full of dirty tracks, write back in the window
+                trstat.dirty_evictions++;
+                flush_slot(s, 1);
+                writer_wait(s->pending);
+                s->pending = 0;
+            }
+        }
+        s->unit = selected_unit;
+        s->track = track;
+        s->prefetched = 0;
+        encode_addr(s);
+    }
+    s->used = ++usecnt;
+    cur = s;
+    trbuf = s->buf;
+    dirty = s->dirty;
+    wave_ok = s->wave_ok;
+}
+
+void trcache_prefetch()
+{
+    // Encode the next track of the unit into a clean slot.
+    // Called at end of rotation, not in the word 257-267 window.
+    // Never writes back or waits for the writer to make room.
+    uint32_t track;
+    struct track_slot *s;
+
+    if (!prefetch || !cur)
+        return;
+    track = cur->track + 1;
+    if (((track+1) << 2) > unit_segs[cur->unit] || lookup(cur->unit, track))
+        return;
+    s = victim();
+    if (s == cur || (s->unit >= 0 && (slot_dirty(s) || slot_busy(s))))
+        return;
+    if (s->unit >= 0)
+        trstat.evictions++;
+    s->unit = cur->unit;
+    s->track = track;
+    s->used = 0;    // First to go on a miss elsewhere
+    s->prefetched = 1;
+    encode_track(s);
+    trstat.prefetches++;
+}
+
+void trcache_scrub()
+{
+    // Check the parity word of the next cached sector. A clean track that
+    // fails is encoded again, a written one can only be reported.
+    static int slot, sect;
+    struct track_slot *s = &slots[slot];
+    uint32_t *trb = s->buf + sect*SECT_WORDS;
+    uint32_t parity;
+
+    if (s->unit >= 0 && s->ready[sect])
+    {
+        parity = ((((s->track<<2) & 0x7FC) + sect) << 8) | 0x80000000;
+        for (int i=0; i<256; i++)
+            parity ^= trb[i];
+        trstat.scrubbed++;
+        if (parity != trb[256])
+        {
+            trstat.scrub_errors++;
+            FBS_TRACE(G_ERROR, EV_SCRUB, s->unit, s->track, sect, slot_dirty(s));
+            if (!slot_dirty(s) && !slot_busy(s))
+                encode_track(s);
+        }
+    }
+    if (++sect == 4)
+    {
+        sect = 0;
+        slot = (slot+1) % nslots;
+    }
+}
+
+void flush_track()
+{
+    // Write back the current track
+    if (cur)
+        flush_slot(cur, 0);
+}
+
+void trcache_writeback()
+{
+    // Write back the least recently used dirty track other than the current
+    struct track_slot *lru = NULL;
+
+    for (struct track_slot *s = slots; s < slots+nslots; s++)
+        if (s != cur && s->unit >= 0 && slot_dirty(s) && (!lru || s->used < lru->used))
+            lru = s;
+    if (lru)
+    {
+        trstat.writebacks++;
+        flush_slot(lru, 0);
+    }
+}
+
+void trcache_flush()
+{
+    // Write back all dirty tracks, as far as the writer ring has room
+    for (struct track_slot *s = slots; s < slots+nslots; s++)
+        if (s->unit >= 0 && !flush_slot(s, 0))
+            return;
+}
+
+int trcache_dirty()
+{
+    // Sectors written in the track cache and not yet queued for the writer
+    for (struct track_slot *s = slots; s < slots+nslots; s++)
+        if (s->unit >= 0 && slot_dirty(s))
+            return 1;
+    return 0;
+}
+
+void trcache_sync()
+{
+    // Write back all dirty tracks and wait until they are in the images
+    for (struct track_slot *s = slots; s < slots+nslots; s++)
+        if (s->unit >= 0)
+            flush_slot(s, 1);
+    writer_drain();
+}
+
+void trcache_reset()
+{
+    // Write back and forget all tracks, the images are about to be unmapped
+    trcache_sync();
+    for (struct track_slot *s = slots; s < slots+nslots; s++)
+    {
+        s->unit = -1;
+        s->pending = 0;
+    }
+    cur = NULL;
+    trbuf = nulltrack;
+    dirty = nulldirty;
+    wave_ok = nullwave;
+}
@@ -0,0 +1,198 @@
+// FBS4000 - Future Backing Storage for RC4000 w. DRC401 and a BeagleBone (tm)
+// Background writer: decodes written sectors and stores them in the images
+//
+// Stores into the MAP_SHARED images can page fault or stall on SD card
+// writeback, so the drum loop only queues (unit, segment, sector) records
+// in a SPSC ring and the writer thread does the rest.
+//
+// With the journal on, records stay in the ring until their batch is
+// committed to the journal, and are then stored (fbs_journal.c).
+//
+// When idle, the writer writes back units with explicit I/O and scrubs
+// (fbs_img.c, fbs_sum.c). It arms a snapshot when it gets to its point
+// (fbs_snap.c).
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include "fbs.h"
+#include "fbs_ring.h"
+
+struct wr_rec
+{
+    int unit;
+    uint32_t seg;
+    uint32_t seq;
+    uint32_t data[257];     // As in trbuf: 256 data words + parity
+    uint32_t file[768/4];   // Decoded sector
+};
+
+static struct spsc_ring ring;
+static uint32_t put_seq;
+static _Atomic uint32_t done_seq;
+static _Atomic int hurry;   // Drum loop waits, commit now
+static pthread_t writer_tid;
+
+struct writer_stats wrstat;
+
+static void store_sector(struct wr_rec *r)
+{
+    // Update sector in file data
+    if (img_drum_track(r->unit, 0))
+    {
+        img_store_drum(r->unit, r->seg, r->data);
+        return;
+    }
+    decode_sector(r->file, r->data);
+    img_store_sector(r->unit, r->seg, r->file);
+}
+
+static void journal_writer()
+{
+    // Log new records, commit and store the batch when it is due
+    struct wr_rec *r;
+    uint32_t logged = 0;    // Oldest records in the ring that are logged
+    uint32_t first = 0;     // clock_ticks() when the first was logged
+    uint32_t n;
+
+    while (1)
+    {
+        for (n = ring_used(&ring); logged < n; logged++)
+        {
+            r = ring_peek(&ring, logged);
+            decode_sector(r->file, r->data);
+            journal_append(r->unit, r->seg, r->file);
+            if (!logged)
+                first = clock_ticks();
+        }
+        if (!logged ||
+            (logged < journal_batch && !atomic_load(&hurry) &&
+             clock_ticks() - first < journal_ms*1000000u))
+        {
+            snap_writer(atomic_load(&done_seq));
+            img_idle();
+            hist_poll();
+            usleep(1000);
+            continue;
+        }
+        atomic_store(&hurry, 0);
+        journal_sync();
+        for (uint32_t i=0; i<logged; i++)
+        {
+            r = ring_peek(&ring, i);
+            snap_writer(r->seq - 1);
+            if (img_drum_track(r->unit, 0))
+                img_store_drum(r->unit, r->seg, r->data);
+            else
+                img_store_sector(r->unit, r->seg, r->file);
+        }
+        journal_checkpoint();
+        atomic_store_explicit(&done_seq, r->seq, memory_order_release);
+        while (logged--)
+            ring_get_done(&ring);
+        logged = 0;
+    }
+}
+
+static void *writer(void *arg)
+{
+    struct wr_rec *r;
+
+    if (journal_on)
+        journal_writer();
+    while (1)
+    {
+        if ((r = ring_get(&ring)) == NULL)
+        {
+            snap_writer(atomic_load(&done_seq));
+            img_idle();
+            hist_poll();
+            usleep(1000);
+            continue;
+        }
+        snap_writer(r->seq - 1);
+        store_sector(r);
+        atomic_store_explicit(&done_seq, r->seq, memory_order_release);
+        ring_get_done(&ring);
+    }
+    return NULL;
+}
+
+void writer_init()
+{
+    char *par;
+    uint32_t depth = 64;
+
+    if ((par = getenv("FBS_WRRING")) != NULL)
+    {
+        depth = strtoul(par, NULL, 0);
+        if (depth < 4) abend("Error in FBS_WRRING (at least 4 sectors)");
+    }
+    if (!ring_init(&ring, depth, sizeof(struct wr_rec)))
+        abend("writer_init");
+    if (pthread_create(&writer_tid, NULL, writer, NULL))
+        abend("pthread_create, writer");
+    FBS_LOG(G_MISC, "Writer ring: %u sectors", ring.size);
+}
+
+uint32_t writer_put(int unit, uint32_t seg, uint32_t *data, int wait)
+{
+    // Queue sector for the writer, returns its sequence number.
+    // If the ring is full, return 0 or wait for room.
+    struct wr_rec *r;
+    uint32_t used;
+
+    while ((r = ring_put(&ring)) == NULL)
+    {
+        wrstat.full++;
+        if (!wait)
+            return 0;
+        usleep(100);
+    }
+    r->unit = unit;
+    r->seg = seg;
+    if (!++put_seq)
+        put_seq++;  // 0 means nothing queued
+    r->seq = put_seq;
+    memcpy(r->data, data, 257*4);
+    ring_put_done(&ring);
+
+    wrstat.queued++;
+    used = ring_used(&ring);
+    if (used > wrstat.maxdepth)
+        wrstat.maxdepth = used;
+    return put_seq;
+}
+
+int writer_done(uint32_t seq)
+{
+    // Has the writer stored the sector queued as seq
+    return (int32_t)(atomic_load_explicit(&done_seq, memory_order_acquire) - seq) >= 0;
+}
+
+void writer_wait(uint32_t seq)
+{
+    if (writer_done(seq))
+        return;
+    wrstat.waits++;
+    atomic_store(&hurry, 1);
+    while (!writer_done(seq))
+        usleep(100);
+}
+
+void writer_drain()
+{
+    // Wait until everything queued is in the images
+    if (put_seq)
+        writer_wait(put_seq);
+}
+
+uint32_t writer_seq()
+{
+    // Last sector queued, 0: none yet
+    return put_seq;
+}
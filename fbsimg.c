@@ -0,0 +1,496 @@
+// FBS4000 - Future Backing Storage for RC4000 w. DRC401 and a BeagleBone (tm)
+// fbsimg: convert, check and compare unit images offline
+//
+// fbsimg [-j threads] command args
+//   drum in out        To drum format
+//   packed in out      To a packed image
+//   export in out      To a dump of 24-bit words
+//   import in out      Dump of 24-bit words to a packed image
+//   verify img [segs]  Size, header and sector parity, segment count
+//   hash img           CRC-32 of every track
+//   diff a b           Tracks that differ
+//   receive sock img0 [img1 ...]
+//                      Mirror of fbs units, UNITn_MIRROR=unix:sock
+//
+// Images are packed (768 bytes per segment, as fbs reads them) or in drum
+// format, recognised by its header: every track as fetch_track() builds
+// it, 4 sectors of 256 DRC words, parity and 11 address words. A word
+// dump holds each RC4000 word in the low 24 bits of a little endian
+// 32-bit word, 1024 per track. Hashes and diffs are of the packed data,
+// so an image and its drum format copy compare equal.
+//
+// Images are read and written in chunks of CHUNK tracks with pread and
+// pwrite by a pool of threads, one per CPU by default.
+//
+// receive listens on a UNIX socket for fbs and writes the sectors it
+// replicates to packed images, one per unit ("-": not mirrored), with an
+// fdatasync per batch. It runs until it is killed.
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <time.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+#include "fbs.h"
+
+#define CHUNK   64      // Tracks, 192 KB packed
+
+enum { F_PACKED, F_DRUM, F_WORDS };
+enum { C_CONVERT, C_VERIFY, C_HASH, C_DIFF };
+
+static const uint32_t track_bytes[] = {768*4, DRUM_TRACK_WORDS*4, 1024*4};
+static const char *fmt_name[] = {"packed", "drum format", "word dump"};
+
+struct image
+{
+    char *name;
+    int fd;
+    int fmt;
+    uint32_t tracks;
+    off_t base;         // Track 0
+    off_t size;
+};
+
+struct job
+{
+    int cmd;
+    struct image *in, *in2, *out;
+    uint32_t tracks;
+    uint32_t *crc;          // C_HASH, per track
+    uint8_t *differ;        // C_DIFF, per track
+    _Atomic uint32_t next;  // Chunk
+    _Atomic uint32_t errors;
+};
+
+uint32_t logmask = 0;   // Sector kernels log through syslog
+
+static uint32_t sect_addr(uint32_t track, int sect)
+{
+    // Parity seed and address words, as in the track cache
+    return ((((track << 2) & 0x7FC) + (sect & 3)) << 8) | 0x80000000;
+}
+
+static void fail(char *name, char *what)
+{
+    fprintf(stderr, "fbsimg: %s: %s\n", name, what);
+    exit(1);
+}
+
+static void open_in(struct image *im, char *name, int words)
+{
+    // Open an image to read, find its format
+    struct drum_hdr h;
+    struct stat sb;
+
+    im->name = name;
+    if ((im->fd = open(name, O_RDONLY)) < 0 || fstat(im->fd, &sb))
+        fail(name, "cannot open");
+    im->size = sb.st_size;
+    im->base = 0;
+    if (words)
+        im->fmt = F_WORDS;
+    else if (pread(im->fd, &h, sizeof(h), 0) == sizeof(h) && !memcmp(h.magic, DRUM_MAGIC, 8))
+    {
+        if (h.version != DRUM_VERSION || h.track_words != DRUM_TRACK_WORDS ||
+            sb.st_size != DRUM_HDR_SIZE + (off_t)h.tracks*DRUM_TRACK_WORDS*4)
+            fail(name, "bad drum format header or size");
+        im->fmt = F_DRUM;
+        im->base = DRUM_HDR_SIZE;
+    }
+    else
+        im->fmt = F_PACKED;
+    im->tracks = (im->size - im->base) / track_bytes[im->fmt];
+    if (!im->tracks)
+        fail(name, "less than one track");
+}
+
+static void open_out(struct image *im, char *name, int fmt, uint32_t tracks)
+{
+    // Create an image of tracks tracks, written by the workers
+    uint8_t hdr[DRUM_HDR_SIZE] = {0};
+    struct drum_hdr *h = (struct drum_hdr *)hdr;
+
+    im->name = name;
+    im->fmt = fmt;
+    im->tracks = tracks;
+    im->base = fmt == F_DRUM ? DRUM_HDR_SIZE : 0;
+    im->size = im->base + (off_t)tracks*track_bytes[fmt];
+    if ((im->fd = open(name, O_WRONLY|O_CREAT|O_TRUNC, 0644)) < 0 || ftruncate(im->fd, im->size))
+        fail(name, "cannot create");
+    if (fmt == F_DRUM)
+    {
+        memcpy(h->magic, DRUM_MAGIC, 8);
+        h->version = DRUM_VERSION;
+        h->tracks = tracks;
+        h->track_words = DRUM_TRACK_WORDS;
+        if (pwrite(im->fd, hdr, sizeof(hdr), 0) != sizeof(hdr))
+            fail(name, "write error");
+    }
+}
+
+static void io(int wr, struct image *im, void *buf, uint32_t t0, uint32_t n)
+{
+    size_t len = (size_t)n*track_bytes[im->fmt];
+    off_t ofs = im->base + (off_t)t0*track_bytes[im->fmt];
+    ssize_t r;
+
+    for (uint8_t *p = buf; len; p+=r, ofs+=r, len-=r)
+        if ((r = wr ? pwrite(im->fd, p, len, ofs) : pread(im->fd, p, len, ofs)) <= 0)
+            fail(im->name, wr ? "write error" : "read error");
+}
+
+static uint32_t get_tracks(struct image *im, uint32_t t0, uint32_t n, uint32_t *file, uint32_t *buf)
+{
+    // Read n tracks from t0 as packed data, return the number of bad
+    // sectors: parity errors, or words over 24 bits in a dump
+    uint32_t errors = 0;
+    uint32_t parity;
+
+    if (im->fmt == F_PACKED)
+    {
+        io(0, im, file, t0, n);
+        return 0;
+    }
+    io(0, im, buf, t0, n);
+    for (uint32_t t=0; t<n; t++)
+    {
+        for (int sect=0; sect<4; sect++)
+        {
+            uint32_t *f = file + t*768 + sect*192;
+
+            if (im->fmt == F_DRUM)
+            {
+                uint32_t *trb = buf + t*DRUM_TRACK_WORDS + sect*SECT_WORDS;
+
+                parity = sect_addr(t0+t, sect);
+                for (int i=0; i<256; i++)
+                    parity ^= trb[i];
+                errors += parity != trb[256];
+                decode_sector(f, trb);
+                continue;
+            }
+            uint32_t *w = buf + t*1024 + sect*256;
+            uint32_t over = 0;
+
+            for (int i=0; i<256; i+=4, w+=4, f+=3)
+            {
+                over |= w[0] | w[1] | w[2] | w[3];
+                f[0] = (w[0] & 0xffffff) | (w[1] << 24);
+                f[1] = ((w[1] >> 8) & 0xffff) | (w[2] << 16);
+                f[2] = ((w[2] >> 16) & 0xff) | (w[3] << 8);
+            }
+            errors += (over >> 24) != 0;
+        }
+    }
+    return errors;
+}
+
+static void put_tracks(struct image *im, uint32_t t0, uint32_t n, uint32_t *file, uint32_t *buf)
+{
+    // Write n tracks of packed data from t0
+    if (im->fmt == F_PACKED)
+    {
+        io(1, im, file, t0, n);
+        return;
+    }
+    for (uint32_t t=0; t<n; t++)
+    {
+        for (int sect=0; sect<4; sect++)
+        {
+            uint32_t *f = file + t*768 + sect*192;
+
+            if (im->fmt == F_DRUM)
+            {
+                uint32_t *trb = buf + t*DRUM_TRACK_WORDS + sect*SECT_WORDS;
+
+                trb[256] = encode_sector(trb, f, sect_addr(t0+t, sect));
+                for (int i=257; i<SECT_WORDS; i++)
+                    trb[i] = sect_addr(t0+t, sect+1);  // Address of the next sector, see DRC018
+                continue;
+            }
+            uint32_t *w = buf + t*1024 + sect*256;
+
+            for (int i=0; i<256; i+=4, w+=4, f+=3)
+            {
+                w[0] = f[0] & 0xffffff;
+                w[1] = (f[0] >> 24) | ((f[1] & 0xffff) << 8);
+                w[2] = (f[1] >> 16) | ((f[2] & 0xff) << 16);
+                w[3] = f[2] >> 8;
+            }
+        }
+    }
+    io(1, im, buf, t0, n);
+}
+
+static void *worker(void *arg)
+{
+    struct job *j = arg;
+    uint32_t *file = malloc(CHUNK*768*4);
+    uint32_t *file2 = malloc(CHUNK*768*4);
+    uint32_t *buf = malloc(CHUNK*DRUM_TRACK_WORDS*4);
+    uint32_t t0, n, errors;
+
+    if (!file || !file2 || !buf)
+        fail("worker", "out of memory");
+    while ((t0 = atomic_fetch_add(&j->next, 1) * CHUNK) < j->tracks)
+    {
+        n = j->tracks - t0 < CHUNK ? j->tracks - t0 : CHUNK;
+        errors = get_tracks(j->in, t0, n, file, buf);
+        switch (j->cmd)
+        {
+            case C_CONVERT:
+                put_tracks(j->out, t0, n, file, buf);
+                break;
+            case C_HASH:
+                for (uint32_t t=0; t<n; t++)
+                    j->crc[t0+t] = fbs_crc32(0, file + t*768, 768*4);
+                break;
+            case C_DIFF:
+                errors += get_tracks(j->in2, t0, n, file2, buf);
+                for (uint32_t t=0; t<n; t++)
+                    j->differ[t0+t] = memcmp(file + t*768, file2 + t*768, 768*4) != 0;
+                break;
+        }
+        atomic_fetch_add(&j->errors, errors);
+    }
+    free(file);
+    free(file2);
+    free(buf);
+    return NULL;
+}
+
+static double now()
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec * 1e-9;
+}
+
+static uint32_t run(struct job *j, int threads)
+{
+    // Work through the chunks, return the number of bad sectors
+    pthread_t tid[threads];
+    double t = now();
+    double mb;
+
+    for (int i=0; i<threads; i++)
+        if (pthread_create(&tid[i], NULL, worker, j))
+            fail("fbsimg", "pthread_create");
+    for (int i=0; i<threads; i++)
+        pthread_join(tid[i], NULL);
+    if (j->out && fsync(j->out->fd))
+        fail(j->out->name, "write error");
+    t = now() - t;
+    mb = (double)j->tracks * track_bytes[j->in->fmt] * (j->in2 ? 2 : 1) / (1024*1024);
+    fprintf(stderr, "fbsimg: %u tracks, %.1f MB read in %.3f s, %.0f MB/s, %d threads\n",
+            j->tracks, mb, t, mb / t, threads);
+    return atomic_load(&j->errors);
+}
+
+static int read_all(int fd, void *buf, size_t len)
+{
+    ssize_t n;
+
+    for (char *p = buf; len; p+=n, len-=n)
+        if ((n = read(fd, p, len)) <= 0)
+            return 0;
+    return 1;
+}
+
+static char **recv_names;
+static int recv_fds[MAXUNITS];
+static int recv_units;
+
+static void *receiver(void *arg)
+{
+    // One connection, fbs has one per mirrored unit
+    int conn = (intptr_t)arg;
+    struct repl_batch b;
+    struct repl_rec r;
+    uint32_t seq = 0, sectors = 0, batches = 0, gaps = 0, bad = 0;
+    int unit = -1;
+
+    while (read_all(conn, &b, sizeof(b)) && b.magic == REPL_MAGIC)
+    {
+        if (b.seq != seq)
+        {
+            fprintf(stderr, "fbsimg: %u sectors missing before %u\n", b.seq - seq, b.seq);
+            gaps++;
+        }
+        seq = b.seq + b.count;
+        batches++;
+        for (uint32_t i=0; i<b.count && read_all(conn, &r, sizeof(r)); i++)
+        {
+            sectors++;
+            if (r.unit >= recv_units || recv_fds[r.unit] < 0)
+            {
+                bad++;
+                continue;
+            }
+            if (pwrite(recv_fds[r.unit], r.data, 768, (off_t)r.seg*768) != 768)
+                fail(recv_names[r.unit], "write error");
+            unit = r.unit;
+        }
+        if (unit >= 0 && fdatasync(recv_fds[unit]))
+            fail(recv_names[unit], "fdatasync");
+    }
+    close(conn);
+    fprintf(stderr, "fbsimg: unit %d closed, %u sectors in %u batches, %u gaps, %u not mirrored\n",
+            unit, sectors, batches, gaps, bad);
+    return NULL;
+}
+
+static void receive(char *path, char **names, int units)
+{
+    // Sectors from fbs to the unit images, a thread per connection
+    struct sockaddr_un sa = {.sun_family = AF_UNIX};
+    pthread_t tid;
+    int sock, conn;
+
+    recv_names = names;
+    recv_units = units;
+    for (int u=0; u<units; u++)
+        if (strcmp(names[u], "-") == 0)
+            recv_fds[u] = -1;
+        else if ((recv_fds[u] = open(names[u], O_RDWR|O_CREAT, 0644)) < 0)
+            fail(names[u], "cannot open");
+    if (strlen(path) >= sizeof(sa.sun_path))
+        fail(path, "socket path too long");
+    strcpy(sa.sun_path, path);
+    unlink(path);
+    if ((sock = socket(AF_UNIX, SOCK_STREAM, 0)) < 0 ||
+        bind(sock, (struct sockaddr *)&sa, sizeof(sa)) || listen(sock, MAXUNITS))
+        fail(path, "cannot listen");
+    while ((conn = accept(sock, NULL, NULL)) >= 0)
+    {
+        if (pthread_create(&tid, NULL, receiver, (void *)(intptr_t)conn))
+            fail(path, "pthread_create");
+        pthread_detach(tid);
+    }
+    fail(path, "accept");
+}
+
+static void usage()
+{
+    fprintf(stderr, "usage: fbsimg [-j threads] drum|packed|export|import in out\n"
+                    "       fbsimg [-j threads] verify img [segs]\n"
+                    "       fbsimg [-j threads] hash img\n"
+                    "       fbsimg [-j threads] diff a b\n"
+                    "       fbsimg receive socket img0 [img1 ...]\n");
+    exit(2);
+}
+
+int main(int argc, char *argv[])
+{
+    int threads = sysconf(_SC_NPROCESSORS_ONLN);
+    struct image in, in2, out;
+    struct job j = {0};
+    uint32_t errors, first, differ = 0;
+    char *cmd;
+    int opt;
+
+    while ((opt = getopt(argc, argv, "j:")) != -1)
+    {
+        if (opt != 'j' || (threads = atoi(optarg)) < 1)
+            usage();
+    }
+    if (argc - optind < 2)
+        usage();
+    cmd = argv[optind++];
+    argc -= optind;
+    argv += optind;
+    kernels_init();
+    fbs_crc32(0, NULL, 0);  // Table, before the threads
+    j.in = &in;
+
+    if (argc == 2 && (!strcmp(cmd, "drum") || !strcmp(cmd, "packed") ||
+                      !strcmp(cmd, "export") || !strcmp(cmd, "import")))
+    {
+        open_in(&in, argv[0], !strcmp(cmd, "import"));
+        open_out(&out, argv[1], !strcmp(cmd, "drum") ? F_DRUM : !strcmp(cmd, "export") ? F_WORDS : F_PACKED,
+                 in.tracks);
+        j.cmd = C_CONVERT;
+        j.out = &out;
+        j.tracks = in.tracks;
+        errors = run(&j, threads);
+        printf("%s: %u tracks, %s from %s, %u bad sectors\n",
+               out.name, out.tracks, fmt_name[out.fmt], fmt_name[in.fmt], errors);
+        return errors != 0;
+    }
+    if ((argc == 1 || argc == 2) && !strcmp(cmd, "verify"))
+    {
+        open_in(&in, argv[0], 0);
+        j.cmd = C_VERIFY;
+        j.tracks = in.tracks;
+        errors = run(&j, threads);
+        printf("%s: %s, %u segments, %u tracks, %u parity errors\n",
+               in.name, fmt_name[in.fmt], in.tracks*4, in.tracks, errors);
+        if (in.size != in.base + (off_t)in.tracks*track_bytes[in.fmt])
+        {
+            printf("%s: %lld bytes after the last whole track\n", in.name,
+                   (long long)(in.size - in.base - (off_t)in.tracks*track_bytes[in.fmt]));
+            errors++;
+        }
+        if (argc == 2 && strtoul(argv[1], NULL, 0) != in.tracks*4)
+        {
+            printf("%s: expected %s segments\n", in.name, argv[1]);
+            errors++;
+        }
+        return errors != 0;
+    }
+    if (argc == 1 && !strcmp(cmd, "hash"))
+    {
+        open_in(&in, argv[0], 0);
+        j.cmd = C_HASH;
+        j.tracks = in.tracks;
+        if (!(j.crc = malloc(in.tracks*4)))
+            fail("fbsimg", "out of memory");
+        errors = run(&j, threads);
+        for (uint32_t t=0; t<in.tracks; t++)
+            printf("%u %08x\n", t, j.crc[t]);
+        if (errors)
+            fprintf(stderr, "fbsimg: %s: %u parity errors\n", in.name, errors);
+        return errors != 0;
+    }
+    if (argc == 2 && !strcmp(cmd, "diff"))
+    {
+        open_in(&in, argv[0], 0);
+        open_in(&in2, argv[1], 0);
+        j.cmd = C_DIFF;
+        j.in2 = &in2;
+        j.tracks = in.tracks < in2.tracks ? in.tracks : in2.tracks;
+        if (!(j.differ = malloc(j.tracks)))
+            fail("fbsimg", "out of memory");
+        errors = run(&j, threads);
+        for (uint32_t t=0; t<j.tracks; t++)
+        {
+            if (!j.differ[t])
+                continue;
+            for (first = t; t+1 < j.tracks && j.differ[t+1]; t++)
+                ;
+            differ += t - first + 1;
+            if (first == t)
+                printf("track %u\n", t);
+            else
+                printf("tracks %u-%u\n", first, t);
+        }
+        if (in.tracks != in2.tracks)
+            printf("%s has %u tracks, %s %u\n", in.name, in.tracks, in2.name, in2.tracks);
+        printf("%u of %u tracks differ\n", differ, j.tracks);
+        if (errors)
+            fprintf(stderr, "fbsimg: %u parity errors\n", errors);
+        return differ || errors || in.tracks != in2.tracks;
+    }
+    if (argc >= 2 && argc <= MAXUNITS+1 && !strcmp(cmd, "receive"))
+        receive(argv[0], argv+1, argc-1);
+    usage();
+    return 2;
+}
@@ -0,0 +1,169 @@
+// FBS4000 - Future Backing Storage for RC4000 w. DRC401 and a BeagleBone (tm)
+// fbsstat: show the statistics segment of a running fbs
+//
+// fbsstat [-j] [-i secs] [-c count] [-s name]
+//   -j        JSON, one object per sample (default once)
+//   -i secs   Sample interval, live display by default every second
+//   -c count  Number of samples
+//   -s name   Segment name, default FBS_SHM or /fbs4000
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <time.h>
+#include <sys/mman.h>
+#include "fbs_stats.h"
+
+static struct fbs_stats *open_stats(char *name)
+{
+    struct fbs_stats *shm;
+    int fd;
+
+    if ((fd = shm_open(name, O_RDONLY, 0)) < 0)
+    {
+        fprintf(stderr, "fbsstat: no segment %s, is fbs running?\n", name);
+        exit(1);
+    }
+    shm = mmap(NULL, sizeof(*shm), PROT_READ, MAP_SHARED, fd, 0);
+    close(fd);
+    if (shm == MAP_FAILED)
+    {
+        perror("fbsstat: mmap");
+        exit(1);
+    }
+    if (shm->magic != FBS_STATS_MAGIC || shm->version != FBS_STATS_VERSION ||
+        shm->size != sizeof(*shm))
+    {
+        fprintf(stderr, "fbsstat: %s has version %u, expected %u\n",
+                name, shm->version, FBS_STATS_VERSION);
+        exit(1);
+    }
+    return shm;
+}
+
+static void print_json(struct fbs_stats *s)
+{
+    printf("{\"version\":%u,\"pid\":%u,\"started\":%u,\"time\":%u,",
+           s->version, s->pid, s->started, (uint32_t)time(NULL));
+    printf("\"power\":%u,\"connected\":%u,\"unit\":%d,\"dsa\":%u,\"power_cycles\":%u,\"connect_us\":%u,",
+           s->power, s->connected, s->unit, s->dsa, s->power_cycles, s->connect_us);
+    printf("\"connect_cold_us\":%u,\"connect_warm_us\":%u,\"connect_warm_max_us\":%u,\"warm_connects\":%u,",
+           s->connect_cold_us, s->connect_warm_us, s->connect_warm_max_us, s->warm_connects);
+    printf("\"rotations\":%u,\"rot_last_us\":%u,\"rot_min_us\":%u,\"rot_max_us\":%u,\"rot_avg_us\":%u,",
+           s->rotations, s->rot_last, s->rotations ? s->rot_min : 0, s->rot_max,
+           s->rotations ? (uint32_t)(s->rot_sum / s->rotations) : 0);
+    printf("\"seeks\":%u,\"unit_selects\":%u,\"seek_errors\":%u,\"wr_faults\":%u,",
+           s->seeks, s->unit_selects, s->seek_errors, s->wr_faults);
+    printf("\"units\":[");
+    for (int u=0; u<FBS_STATS_UNITS; u++)
+        printf("%s{\"segs\":%u,\"reads\":%u,\"writes\":%u}",
+               u ? "," : "", s->segs[u], s->reads[u], s->writes[u]);
+    printf("],");
+    printf("\"trcache\":{\"hits\":%u,\"misses\":%u,\"evictions\":%u,\"dirty_evictions\":%u,\"writebacks\":%u,"
+           "\"prefetches\":%u,\"prefetch_hits\":%u,\"prefetch_misses\":%u},",
+           s->tc_hits, s->tc_misses, s->tc_evictions, s->tc_dirty_evictions, s->tc_writebacks,
+           s->tc_prefetches, s->tc_pf_hits, s->tc_pf_misses);
+    printf("\"writer\":{\"queued\":%u,\"full\":%u,\"maxdepth\":%u,\"waits\":%u},",
+           s->wr_queued, s->wr_full, s->wr_maxdepth, s->wr_waits);
+    printf("\"io\":{\"dirtied\":%llu,\"written\":%llu,\"writes\":%u},",
+           (unsigned long long)s->io_dirtied, (unsigned long long)s->io_written, s->io_writes);
+    printf("\"scrub\":{\"checked\":%u,\"passes\":%u,\"errors\":%u,\"unit\":%d,\"track\":%u},",
+           s->sum_checked, s->sum_passes, s->sum_errors, s->sum_unit, s->sum_track);
+    printf("\"mirror\":{\"queued\":%u,\"sent\":%u,\"batches\":%u,\"lag\":%u,\"resynced\":%u,\"pending\":%u},",
+           s->repl_queued, s->repl_sent, s->repl_batches, s->repl_lag, s->repl_resynced, s->repl_pending);
+    printf("\"trace_lost\":%u}\n", s->trace_lost);
+}
+
+static void print_live(struct fbs_stats *s, struct fbs_stats *prev, double secs)
+{
+    // Totals and rates since the previous sample
+#define RATE(f) ((s->f - prev->f) / secs)
+    if (isatty(1))
+        printf("\033[H\033[J");
+    printf("fbs pid %u  up %us  power %s  %s  unit %d  dsa %u  power cycles %u\n",
+           s->pid, (uint32_t)time(NULL) - s->started, s->power ? "on" : "off",
+           s->connected ? "connected" : "disconnected", s->unit, s->dsa, s->power_cycles);
+    printf("connect %.3f ms  cold %.3f ms  warm %.3f ms  max %.3f ms  warm connects %u\n",
+           s->connect_us / 1e3, s->connect_cold_us / 1e3, s->connect_warm_us / 1e3,
+           s->connect_warm_max_us / 1e3, s->warm_connects);
+    printf("rotations %u (%.0f/s)  last %u us  min %u  max %u  avg %u\n",
+           s->rotations, RATE(rotations), s->rot_last, s->rotations ? s->rot_min : 0, s->rot_max,
+           s->rotations ? (uint32_t)(s->rot_sum / s->rotations) : 0);
+    printf("seeks %u (%.0f/s)  unit selects %u  seek errors %u  write errors %u\n",
+           s->seeks, RATE(seeks), s->unit_selects, s->seek_errors, s->wr_faults);
+    printf("unit    segs       reads       /s      writes       /s\n");
+    for (int u=0; u<FBS_STATS_UNITS; u++)
+        if (s->segs[u])
+            printf("%4d %7u %11u %8.0f %11u %8.0f\n", u, s->segs[u],
+                   s->reads[u], RATE(reads[u]), s->writes[u], RATE(writes[u]));
+    printf("track cache hit/miss/evict %u/%u/%u  writeback in window %u  at rotation end %u\n",
+           s->tc_hits, s->tc_misses, s->tc_evictions, s->tc_dirty_evictions, s->tc_writebacks);
+    printf("prefetch %u  hit %u  miss %u\n", s->tc_prefetches, s->tc_pf_hits, s->tc_pf_misses);
+    printf("writer queued %u (%.0f/s)  ring full %u  max depth %u  waits %u\n",
+           s->wr_queued, RATE(wr_queued), s->wr_full, s->wr_maxdepth, s->wr_waits);
+    if (s->io_dirtied)
+        printf("image I/O dirtied %llu KB  written %llu KB (%.1fx)  writes %u\n",
+               (unsigned long long)s->io_dirtied/1024, (unsigned long long)s->io_written/1024,
+               (double)s->io_written / s->io_dirtied, s->io_writes);
+    if (s->sum_unit >= 0)
+        printf("scrub unit %d track %u/%u  checked %u tracks  passes %u  checksum errors %u\n",
+               s->sum_unit, s->sum_track, s->segs[s->sum_unit & 3] / 4, s->sum_checked,
+               s->sum_passes, s->sum_errors);
+    if (s->repl_queued || s->repl_resynced || s->repl_pending)
+        printf("mirror queued %u  sent %u (%.0f/s)  batches %u  lag %u  resynced %u tracks  pending %u\n",
+               s->repl_queued, s->repl_sent, RATE(repl_sent), s->repl_batches, s->repl_lag,
+               s->repl_resynced, s->repl_pending);
+    printf("trace events lost %u\n", s->trace_lost);
+    fflush(stdout);
+#undef RATE
+}
+
+int main(int argc, char *argv[])
+{
+    char *name = getenv("FBS_SHM");
+    int json = 0;
+    double interval = 0;
+    long count = 0;
+    struct fbs_stats *shm;
+    struct fbs_stats cur, prev;
+    int opt;
+
+    while ((opt = getopt(argc, argv, "ji:c:s:")) != -1)
+    {
+        switch (opt)
+        {
+            case 'j': json = 1; break;
+            case 'i': interval = atof(optarg); break;
+            case 'c': count = atol(optarg); break;
+            case 's': name = optarg; break;
+            default:
+                fprintf(stderr, "usage: fbsstat [-j] [-i secs] [-c count] [-s name]\n");
+                return 2;
+        }
+    }
+    if (!name || !*name)
+        name = FBS_STATS_SHM;
+    if (interval <= 0)
+    {
+        interval = 1;
+        if (json && !count)
+            count = 1;
+    }
+    shm = open_stats(name);
+    stats_read(&prev, shm);
+    for (long n=0; !count || n<count; n++)
+    {
+        if (n || !json)
+            usleep(interval * 1e6);
+        stats_read(&cur, shm);
+        if (json)
+            print_json(&cur);
+        else
+            print_live(&cur, &prev, interval);
+        prev = cur;
+    }
+    return 0;
+}